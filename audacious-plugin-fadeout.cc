@@ -22,16 +22,45 @@
 
 // expected to be generated by the build system
 #include "plugin_export.h"
+#include "fadecore.h"
 
+#include <libaudcore/audio.h>
+#include <libaudcore/audstrings.h>
 #include <libaudcore/drct.h>
+#include <libaudcore/hook.h>
 #include <libaudcore/i18n.h>
 #include <libaudcore/interface.h>
+#include <libaudcore/multihash.h>
 #include <libaudcore/plugin.h>
 #include <libaudcore/preferences.h>
 #include <libaudcore/runtime.h>
+#include <libaudcore/tuple.h>
+#include <libaudcore/vfs.h>
 
+#include <errno.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <atomic>
 
 // PACKAGE should be defined by the build system
 #ifndef PACKAGE
@@ -42,10 +71,139 @@
 #define AUD_CFG_SECTION "fadeout_plugin"
 // config DB key for the duration
 #define AUD_CFG_KEY_DURATION "duration"
+// config DB key for letting fades end on a detected beat
+#define AUD_CFG_KEY_BEAT_ALIGN "beat_align"
+// config DB key for automatically fading out the end of analyzed songs
+#define AUD_CFG_KEY_AUTO_FADE "auto_fade"
+// config DB key for the time constant (in ms) of the final gain smoother
+#define AUD_CFG_KEY_SMOOTHING "smoothing"
+// config DB key for letting a fade-out continue into the next song
+#define AUD_CFG_KEY_ACROSS_SONGS "across_songs"
+// config DB key for the duration of the fade-out before quitting Audacious
+#define AUD_CFG_KEY_QUIT_DURATION "quit_duration"
+// config DB key for narrowing stereo songs to mono while fading out
+#define AUD_CFG_KEY_WIDTH_FADE "width_fade"
+// config DB keys for letting fade-outs end in the echoes of a feedback delay,
+// and its delay (in ms; one beat instead if beats are detected)
+#define AUD_CFG_KEY_ECHO_OUT "echo_out"
+#define AUD_CFG_KEY_ECHO_DELAY "echo_delay"
+// config DB key for fading out high frequencies before low ones
+#define AUD_CFG_KEY_SPECTRAL_FADE "spectral_fade"
+// config DB key for slowing songs down (at the same pitch) while fading out
+#define AUD_CFG_KEY_RITARDANDO "ritardando"
+// config DB key for adapting the fade floor to how loud a song plays
+#define AUD_CFG_KEY_LEVEL_AWARE "level_aware"
+// config DB key for the CPU budget of the background analysis
+#define AUD_CFG_KEY_ANALYSIS_BUDGET "analysis_budget"
+// config DB key for the time (in ms) by which the audio is delayed, so that
+// it can be looked at before it is heard
+#define AUD_CFG_KEY_LOOKAHEAD "lookahead"
+// config DB keys for the ducking level (in dB) and its fade time
+#define AUD_CFG_KEY_DUCK_LEVEL "duck_level"
+#define AUD_CFG_KEY_DUCK_DURATION "duck_duration"
+// config DB keys for ducking automatically whenever a sidechain source (an
+// ALSA capture device or a named pipe) gets loud
+#define AUD_CFG_KEY_SIDECHAIN_SOURCE "sidechain_source"
+#define AUD_CFG_KEY_SIDECHAIN_THRESHOLD "sidechain_threshold"
+#define AUD_CFG_KEY_SIDECHAIN_ATTACK "sidechain_attack"
+#define AUD_CFG_KEY_SIDECHAIN_RELEASE "sidechain_release"
+// config DB keys for the sleep timer: a time of day ("HH:MM") and a number of
+// minutes after which to fade out
+#define AUD_CFG_KEY_SLEEP_TIME "sleep_time"
+#define AUD_CFG_KEY_SLEEP_MINUTES "sleep_minutes"
+// config DB key for the song position ("M:SS.mmm") at which to fade out
+#define AUD_CFG_KEY_FADE_POSITION "fade_position"
+// config DB key for a sequence of fade steps, e.g. "out 3, next, in 1"
+#define AUD_CFG_KEY_FADE_SEQUENCE "fade_sequence"
 // maximum possible duration for a fade-out (in seconds)
 #define MAX_DURATION 10
 // maximum volume reduction (200 roughly corresponds to silence)
 #define MAX_VOL_REDUCTION 200
+// the gain at the end of a fade-out
+#define FADE_FLOOR (1.0 / MAX_VOL_REDUCTION)
+// mean loudness (in dBFS, as in a song analysis) of a song which plays at the
+// ReplayGain reference level
+#define REFERENCE_LOUDNESS -18
+// maximum adjustment (in dB) of the fade floor to the loudness of a song
+#define MAX_FLOOR_ADJUSTMENT 20
+// maximum duration (in seconds) of the fade-out on quitting
+#define MAX_QUIT_DURATION 3
+// time (in ms) by which quitting waits longer than the fade-out before it gives
+// up, e.g., because the output is stalled
+#define QUIT_FADE_GRACE_MS 500
+// interval (in ms) at which the main loop checks whether the fade-out on
+// quitting is done
+#define QUIT_POLL_MS 10
+// maximum lookahead (in ms)
+#define MAX_LOOKAHEAD 500
+// maximum number of fade commands waiting for the audio thread (per stream)
+#define FADE_QUEUE_SIZE 16
+// maximum number of queued steps of fade sequences (per stream)
+#define FADE_SEQUENCE_SIZE 32
+// maximum number of streams which are processed at the same time
+#define MAX_STREAMS 4
+// time (in ms) after which a stream which is not processed anymore (e.g., as
+// its audio thread ended in the middle of a song) can be taken over
+#define STREAM_IDLE_MS 1000
+// sample rate (in Hz) of the sidechain audio; mono, signed 16 bit samples
+#define SIDECHAIN_RATE 16000
+// number of sidechain frames read at once (5 ms)
+#define SIDECHAIN_PERIOD 80
+// attack and release times (in ms) for detecting the sidechain level
+#define SIDECHAIN_DETECT_ATTACK 1
+#define SIDECHAIN_DETECT_RELEASE 50
+// time (in ms) without changes to the sidechain settings after which the
+// capture is restarted, so that it is not reopened on every keystroke
+#define SIDECHAIN_RESTART_DELAY_MS 1000
+// time (in ms) by which the sleep timer fires ahead of its deadline, so that
+// the audio thread can start the fade-out at the exact frame
+#define SLEEP_TIMER_LEAD_MS 200
+// share of a fade-out in which the width of a stereo song collapses to mono
+#define WIDTH_FADE_SHARE 0.5
+// time (in seconds) in which the width is restored after a fade-out
+#define WIDTH_RESTORE_TIME 0.05
+// maximum delay (in ms) of the echoes of an echo-out
+#define MAX_ECHO_DELAY 1000
+// the share of the echoes fed back into the delay line as an echo-out starts
+#define ECHO_FEEDBACK 0.6
+// share of an echo-out in which the song itself fades out
+#define ECHO_DRY_SHARE 0.5
+// time (in seconds) in which the echoes die away after a cancelled fade-out
+#define ECHO_CANCEL_TIME 0.2
+// the tempo at the end of a fade-out with ritardando
+#define RITARDANDO_TEMPO 0.5
+// approximate sample rate (in Hz) of the audio fed to the beat tracker
+#define ONSET_RATE 11025
+// size of the FFT frames used for onset detection (must be a power of two)
+#define ONSET_FFT_SIZE 512
+// number of samples between two onset detection frames
+#define ONSET_HOP 128
+// number of onset detection frames kept for the tempo estimation
+#define ONSET_HISTORY 512
+// number of samples buffered between the audio and the analysis thread
+#define ONSET_RING_SIZE 65536
+// tempo range (in beats per minute) considered by the beat tracker
+#define MIN_BPM 60
+#define MAX_BPM 200
+// maximum age (in seconds) of the last detected beat for aligning a fade
+#define MAX_BEAT_AGE 4
+// length (in milliseconds) of the windows of a song's loudness profile
+#define PROFILE_WINDOW_MS 500
+// maximum number of windows of a song's loudness profile (four hours)
+#define MAX_PROFILE_WINDOWS (4 * 3600 * 1000 / PROFILE_WINDOW_MS)
+// level (in dBFS) below which a profile window is considered silent
+#define SILENCE_LEVEL -60
+// file (in the Audacious user directory) which caches the song analyses
+#define ANALYSIS_CACHE_FILE "fadeout-analysis"
+// number of threads running background analysis jobs
+#define ANALYSIS_WORKERS 2
+// maximum number of queued background analysis jobs
+#define ANALYSIS_QUEUE_SIZE 64
+// CPU time (in microseconds) a worker may use before it checks its budget
+#define ANALYSIS_SLICE_US 2000
+// number of buffered onset samples which are worth an analysis job
+#define ONSET_JOB_SAMPLES (8 * ONSET_HOP)
+
 
 static const char fadeout_about[] =
     N_("FadeOut Plugin\n"
@@ -56,18 +214,891 @@ static const char fadeout_about[] =
 // defaults for the configuration database
 static const char * const fadeout_defaults[] = {
     AUD_CFG_KEY_DURATION, "4",
+    AUD_CFG_KEY_BEAT_ALIGN, "FALSE",
+    AUD_CFG_KEY_SMOOTHING, "5",
+    AUD_CFG_KEY_AUTO_FADE, "FALSE",
+    AUD_CFG_KEY_LEVEL_AWARE, "FALSE",
+    AUD_CFG_KEY_WIDTH_FADE, "FALSE",
+    AUD_CFG_KEY_ECHO_OUT, "FALSE",
+    AUD_CFG_KEY_ECHO_DELAY, "375",
+    AUD_CFG_KEY_SPECTRAL_FADE, "FALSE",
+    AUD_CFG_KEY_RITARDANDO, "FALSE",
+    AUD_CFG_KEY_ACROSS_SONGS, "FALSE",
+    AUD_CFG_KEY_QUIT_DURATION, "1.5",
+    AUD_CFG_KEY_ANALYSIS_BUDGET, "25",
+    AUD_CFG_KEY_LOOKAHEAD, "0",
+    AUD_CFG_KEY_DUCK_LEVEL, "-18",
+    AUD_CFG_KEY_DUCK_DURATION, "1",
+    AUD_CFG_KEY_SIDECHAIN_SOURCE, "",
+    AUD_CFG_KEY_SIDECHAIN_THRESHOLD, "-40",
+    AUD_CFG_KEY_SIDECHAIN_ATTACK, "10",
+    AUD_CFG_KEY_SIDECHAIN_RELEASE, "500",
+    AUD_CFG_KEY_SLEEP_TIME, "23:30",
+    AUD_CFG_KEY_SLEEP_MINUTES, "45",
+    AUD_CFG_KEY_FADE_POSITION, "3:00.000",
+    AUD_CFG_KEY_FADE_SEQUENCE, "out 3, next, in 1, play 30, out 5, stop",
     nullptr
 };
 
+static void beat_align_changed_cb ();
+static void auto_fade_changed_cb ();
+static void across_songs_changed_cb ();
+static void smoothing_changed_cb ();
+static void width_fade_changed_cb ();
+static void echo_changed_cb ();
+static void spectral_fade_changed_cb ();
+static void ritardando_changed_cb ();
+static void analysis_budget_changed_cb ();
+static void lookahead_changed_cb ();
+static void sidechain_changed_cb ();
+
 static const PreferencesWidget fadeout_widgets[] = {
     WidgetLabel (N_("<b>Fade out</b>")),
     WidgetSpin (N_("Duration:"),
         WidgetFloat (AUD_CFG_SECTION, AUD_CFG_KEY_DURATION),
-        {1, MAX_DURATION, 0.1, N_("seconds")})
+        {1, MAX_DURATION, 0.1, N_("seconds")}),
+    WidgetCheck (N_("End the fade on a beat"),
+        WidgetBool (AUD_CFG_SECTION, AUD_CFG_KEY_BEAT_ALIGN,
+            beat_align_changed_cb)),
+    WidgetSpin (N_("Smoothing of gain jumps:"),
+        WidgetFloat (AUD_CFG_SECTION, AUD_CFG_KEY_SMOOTHING,
+            smoothing_changed_cb),
+        {0.1, 50, 0.1, N_("ms")}),
+    WidgetCheck (N_("Fade out the end of analyzed songs automatically"),
+        WidgetBool (AUD_CFG_SECTION, AUD_CFG_KEY_AUTO_FADE,
+            auto_fade_changed_cb)),
+    WidgetCheck (N_("Narrow stereo to mono while fading out"),
+        WidgetBool (AUD_CFG_SECTION, AUD_CFG_KEY_WIDTH_FADE,
+            width_fade_changed_cb)),
+    WidgetCheck (N_("Fade out into echoes"),
+        WidgetBool (AUD_CFG_SECTION, AUD_CFG_KEY_ECHO_OUT, echo_changed_cb)),
+    WidgetSpin (N_("Echo delay (unless beats are detected):"),
+        WidgetInt (AUD_CFG_SECTION, AUD_CFG_KEY_ECHO_DELAY, echo_changed_cb),
+        {50, MAX_ECHO_DELAY, 5, N_("ms")}),
+    WidgetCheck (N_("Fade out high frequencies first"),
+        WidgetBool (AUD_CFG_SECTION, AUD_CFG_KEY_SPECTRAL_FADE,
+            spectral_fade_changed_cb)),
+    WidgetCheck (N_("Slow down while fading out (at the same pitch)"),
+        WidgetBool (AUD_CFG_SECTION, AUD_CFG_KEY_RITARDANDO,
+            ritardando_changed_cb)),
+    WidgetCheck (N_("Adapt fades to the loudness of songs (ReplayGain)"),
+        WidgetBool (AUD_CFG_SECTION, AUD_CFG_KEY_LEVEL_AWARE)),
+    WidgetCheck (N_("Keep fading out into the next song"),
+        WidgetBool (AUD_CFG_SECTION, AUD_CFG_KEY_ACROSS_SONGS,
+            across_songs_changed_cb)),
+    WidgetSpin (N_("Duration on quitting:"),
+        WidgetFloat (AUD_CFG_SECTION, AUD_CFG_KEY_QUIT_DURATION),
+        {0.1, MAX_QUIT_DURATION, 0.1, N_("seconds")}),
+    WidgetSpin (N_("CPU budget for analysis:"),
+        WidgetInt (AUD_CFG_SECTION, AUD_CFG_KEY_ANALYSIS_BUDGET,
+            analysis_budget_changed_cb),
+        {1, 100, 1, N_("percent")}),
+    WidgetSpin (N_("Lookahead:"),
+        WidgetInt (AUD_CFG_SECTION, AUD_CFG_KEY_LOOKAHEAD,
+            lookahead_changed_cb),
+        {0, MAX_LOOKAHEAD, 10, N_("ms")}),
+    WidgetLabel (N_("<b>Ducking</b>")),
+    WidgetSpin (N_("Level:"),
+        WidgetFloat (AUD_CFG_SECTION, AUD_CFG_KEY_DUCK_LEVEL,
+            sidechain_changed_cb),
+        {-60, -1, 1, N_("dB")}),
+    WidgetSpin (N_("Fade time:"),
+        WidgetFloat (AUD_CFG_SECTION, AUD_CFG_KEY_DUCK_DURATION),
+        {0.1, MAX_DURATION, 0.1, N_("seconds")}),
+    WidgetEntry (N_("Duck automatically for (ALSA device or pipe):"),
+        WidgetString (AUD_CFG_SECTION, AUD_CFG_KEY_SIDECHAIN_SOURCE,
+            sidechain_changed_cb)),
+    WidgetSpin (N_("Threshold:"),
+        WidgetFloat (AUD_CFG_SECTION, AUD_CFG_KEY_SIDECHAIN_THRESHOLD,
+            sidechain_changed_cb),
+        {-80, 0, 1, N_("dB")}),
+    WidgetSpin (N_("Attack:"),
+        WidgetFloat (AUD_CFG_SECTION, AUD_CFG_KEY_SIDECHAIN_ATTACK,
+            sidechain_changed_cb),
+        {1, 1000, 1, N_("ms")}),
+    WidgetSpin (N_("Release:"),
+        WidgetFloat (AUD_CFG_SECTION, AUD_CFG_KEY_SIDECHAIN_RELEASE,
+            sidechain_changed_cb),
+        {10, 5000, 10, N_("ms")}),
+    WidgetLabel (N_("<b>Sleep timer</b>")),
+    WidgetEntry (N_("Fade out at (HH:MM):"),
+        WidgetString (AUD_CFG_SECTION, AUD_CFG_KEY_SLEEP_TIME)),
+    WidgetSpin (N_("Fade out after:"),
+        WidgetFloat (AUD_CFG_SECTION, AUD_CFG_KEY_SLEEP_MINUTES),
+        {1, 1440, 1, N_("minutes")}),
+    WidgetLabel (N_("<b>Song position</b>")),
+    WidgetEntry (N_("Fade out at (M:SS.mmm):"),
+        WidgetString (AUD_CFG_SECTION, AUD_CFG_KEY_FADE_POSITION)),
+    WidgetLabel (N_("<b>Fade sequence</b>")),
+    WidgetEntry (N_("Steps (out/in/play N, next, stop):"),
+        WidgetString (AUD_CFG_SECTION, AUD_CFG_KEY_FADE_SEQUENCE))
 };
 
 static const PluginPreferences fadeout_prefs = {{fadeout_widgets}};
 
+// the configured lookahead (in ms)
+static std::atomic<int> lookahead_ms (0);
+
+/* The level of one channel of the faded signal, measured over the last block
+ * that was processed while fading; written by the audio thread only and read
+ * lock-free from anywhere else. */
+struct ChannelLevel
+{
+    std::atomic<float> peak;
+    std::atomic<float> rms;
+};
+
+static ChannelLevel channel_levels[AUD_MAX_CHANNELS];
+// the number of channels in channel_levels
+static std::atomic<int> measured_channels (0);
+
+static_assert (AUD_MAX_CHANNELS <= FADECORE_MAX_CHANNELS,
+    "fadecore supports fewer channels than Audacious");
+
+/* Logs the last measured levels, e.g., to confirm that a fade actually reached
+ * the floor before playback was stopped. */
+static void log_channel_levels ()
+{
+    int channels = measured_channels.load ();
+    for (int c = 0; c < channels; c++)
+    {
+        float peak = channel_levels[c].peak.load (std::memory_order_relaxed);
+        float rms = channel_levels[c].rms.load (std::memory_order_relaxed);
+        AUDINFO ("Channel %d after fading: peak %.1f dBFS, RMS %.1f dBFS\n", c,
+            gain_to_db (peak), gain_to_db (rms));
+    }
+}
+
+/* A job for the background analysis workers. */
+struct AnalysisJob
+{
+    void (* run) (void * data);
+    // called instead of run if the job cannot be queued or is discarded
+    void (* drop) (void * data);
+    void * data;
+};
+
+// the queued background analysis jobs
+static BoundedQueue<AnalysisJob, ANALYSIS_QUEUE_SIZE> analysis_queue;
+// counts the queued jobs for waking up idle workers
+static sem_t analysis_jobs;
+// keeps the workers running as long as it is set
+static std::atomic<bool> analysis_running (false);
+// the number of threads in submit_analysis(), which the shutdown waits for
+static std::atomic<int> analysis_submitters (0);
+// the share of one CPU (in percent) the workers may use altogether
+static std::atomic<int> analysis_budget (25);
+static GThread * analysis_threads[ANALYSIS_WORKERS];
+// the CPU time (in microseconds) of a worker since it last yielded
+static thread_local int64_t analysis_cpu_mark = 0;
+
+static int64_t thread_cpu_time_us ()
+{
+    struct timespec time;
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, & time);
+    return (int64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+/* Queues a background analysis job; lock-free, i.e., it may be called from the
+ * audio thread. Drops the job if the queue is full, so that pending work never
+ * piles up. */
+static bool submit_analysis (const AnalysisJob & job)
+{
+    /* announce the submission before looking at analysis_running, so that
+     * the workers are not stopped (and the semaphore destroyed) before the
+     * job is either queued and posted or dropped */
+    analysis_submitters.fetch_add (1);
+
+    bool queued = analysis_running.load () && analysis_queue.push (job);
+    if (queued)
+        sem_post (& analysis_jobs);
+    else if (job.drop)
+        job.drop (job.data);
+
+    analysis_submitters.fetch_sub (1);
+    return queued;
+}
+
+/* Lets a worker pause as long as needed for staying within the CPU budget; to
+ * be called by long-running jobs every now and then. */
+static void analysis_yield ()
+{
+    int64_t used = thread_cpu_time_us () - analysis_cpu_mark;
+    if (used < ANALYSIS_SLICE_US)
+        return;
+
+    /* if each of the workers may use a fraction b of a CPU, then it has to
+     * idle (1 - b) / b times as long as it was busy */
+    double budget = analysis_budget.load () / (100.0 * ANALYSIS_WORKERS);
+    if (budget < 1)
+        g_usleep (used * (1 - budget) / budget);
+    else
+        g_thread_yield ();
+
+    analysis_cpu_mark = thread_cpu_time_us ();
+}
+
+/* a GThreadFunc which runs background analysis jobs at the lowest possible
+ * scheduling priority */
+static gpointer analysis_thread (gpointer data)
+{
+#ifdef SCHED_IDLE
+    struct sched_param param = {0};
+    if (pthread_setschedparam (pthread_self (), SCHED_IDLE, & param) != 0)
+#endif
+        // on Linux, this only affects the calling thread
+        setpriority (PRIO_PROCESS, 0, 19);
+
+    analysis_cpu_mark = thread_cpu_time_us ();
+
+    for (;;)
+    {
+        // a signal ends the wait without a job, which is waited for again
+        while (sem_wait (& analysis_jobs) < 0 && errno == EINTR)
+            continue;
+        if (! analysis_running.load ())
+            break;
+
+        /* a job was pushed completely before the semaphore was posted, but a
+         * concurrent push to an earlier slot may still be in progress */
+        AnalysisJob job;
+        while (! analysis_queue.pop (job))
+            g_thread_yield ();
+
+        job.run (job.data);
+        analysis_yield ();
+    }
+
+    return NULL;
+}
+
+static void start_analysis_workers ()
+{
+    sem_init (& analysis_jobs, 0, 0);
+    analysis_running.store (true);
+
+    for (GThread * & thread : analysis_threads)
+        thread = g_thread_new (NULL, (GThreadFunc) analysis_thread, NULL);
+}
+
+/* Stops the workers after their current jobs and drops the remaining ones. */
+static void stop_analysis_workers ()
+{
+    analysis_running.store (false);
+
+    // no job can be queued anymore once the current submissions are done
+    while (analysis_submitters.load ())
+        g_thread_yield ();
+
+    for (int i = 0; i < ANALYSIS_WORKERS; i++)
+        sem_post (& analysis_jobs);
+    for (GThread * & thread : analysis_threads)
+    {
+        g_thread_join (thread);
+        thread = nullptr;
+    }
+
+    AnalysisJob job;
+    while (analysis_queue.pop (job))
+    {
+        if (job.drop)
+            job.drop (job.data);
+    }
+
+    sem_destroy (& analysis_jobs);
+}
+
+/* Updates analysis_budget from the config DB. */
+static void analysis_budget_changed_cb ()
+{
+    analysis_budget.store (aud::clamp (aud_get_int (AUD_CFG_SECTION,
+        AUD_CFG_KEY_ANALYSIS_BUDGET), 1, 100));
+}
+
+/* A lock-free ring buffer for passing samples from exactly one producer
+ * thread to exactly one consumer thread; Capacity must be a power of two. The
+ * read and write positions are never wrapped, so they also count the total
+ * number of samples that went through the ring. */
+template<int Capacity>
+class SampleRing
+{
+public:
+    /* Appends either all of the given samples or none of them if they do not
+     * fit; to be called from the producer thread only. */
+    bool push (const float * samples, int count)
+    {
+        uint64_t head = m_head.load (std::memory_order_relaxed);
+        uint64_t tail = m_tail.load (std::memory_order_acquire);
+        if (head - tail + count > Capacity)
+            return false;
+
+        for (int i = 0; i < count; i++)
+            m_data[(head + i) & (Capacity - 1)] = samples[i];
+
+        m_head.store (head + count, std::memory_order_release);
+        return true;
+    }
+
+    /* Removes up to count samples and returns how many were actually removed;
+     * to be called from the consumer thread only. */
+    int pop (float * samples, int count)
+    {
+        uint64_t tail = m_tail.load (std::memory_order_relaxed);
+        uint64_t head = m_head.load (std::memory_order_acquire);
+        if (head - tail < (uint64_t) count)
+            count = head - tail;
+
+        for (int i = 0; i < count; i++)
+            samples[i] = m_data[(tail + i) & (Capacity - 1)];
+
+        m_tail.store (tail + count, std::memory_order_release);
+        return count;
+    }
+
+    /* Drops all samples which are currently buffered; consumer thread only. */
+    void discard ()
+        { m_tail.store (m_head.load (std::memory_order_acquire),
+              std::memory_order_release); }
+
+    uint64_t written () const
+        { return m_head.load (std::memory_order_acquire); }
+    uint64_t read () const
+        { return m_tail.load (std::memory_order_acquire); }
+
+private:
+    // keep both positions on separate cache lines to avoid false sharing
+    alignas (64) std::atomic<uint64_t> m_head {0};
+    alignas (64) std::atomic<uint64_t> m_tail {0};
+    alignas (64) float m_data[Capacity];
+};
+
+/* A streaming beat tracker: computes the spectral flux of the incoming
+ * (decimated, mono) audio as an onset envelope, estimates the tempo by
+ * autocorrelation of that envelope and finally the phase of the beat grid by
+ * a comb filter. Positions are counted in samples of the analyzed audio. */
+class BeatTracker
+{
+public:
+    void reset (uint64_t position, int rate)
+    {
+        memset (m_frame, 0, sizeof m_frame);
+        memset (m_last_spectrum, 0, sizeof m_last_spectrum);
+        memset (m_onsets, 0, sizeof m_onsets);
+        m_start = position;
+        m_rate = rate;
+        m_pending = 0;
+        m_hops = 0;
+        m_period = 0;
+        m_beat = 0;
+    }
+
+    void analyze (const float * samples, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            m_frame[ONSET_FFT_SIZE - ONSET_HOP + m_pending] = samples[i];
+            if (++ m_pending == ONSET_HOP)
+            {
+                detect_onset ();
+                memmove (m_frame, m_frame + ONSET_HOP,
+                    (ONSET_FFT_SIZE - ONSET_HOP) * sizeof (float));
+                m_pending = 0;
+
+                // re-estimate the tempo about every half second
+                if (m_hops >= ONSET_HISTORY / 2 &&
+                    m_hops % (m_rate / ONSET_HOP / 2 + 1) == 0)
+                    estimate_beats ();
+            }
+        }
+    }
+
+    // the estimated beat period in samples; 0 if no tempo was found (yet)
+    double period () const
+        { return m_period; }
+    // the position of the most recently detected beat
+    double beat () const
+        { return m_beat; }
+
+private:
+    void detect_onset ()
+    {
+        for (int i = 0; i < ONSET_FFT_SIZE; i++)
+        {
+            double hann = 0.5 - 0.5 * cos (2 * M_PI * i / ONSET_FFT_SIZE);
+            m_re[i] = m_frame[i] * hann;
+            m_im[i] = 0;
+        }
+
+        m_fft.transform (m_re, m_im);
+
+        // sum up the (log-compressed) increases of the magnitude spectrum
+        float flux = 0;
+        for (int k = 1; k < ONSET_FFT_SIZE / 2; k++)
+        {
+            float magnitude = log1pf (100 * sqrtf (m_re[k] * m_re[k] +
+                m_im[k] * m_im[k]));
+            flux += fmaxf (magnitude - m_last_spectrum[k], 0);
+            m_last_spectrum[k] = magnitude;
+        }
+
+        m_onsets[m_hops % ONSET_HISTORY] = flux;
+        m_hops ++;
+    }
+
+    void estimate_beats ()
+    {
+        // unroll the onset history into chronological order without its mean
+        float onsets[ONSET_HISTORY];
+        double mean = 0;
+        for (int i = 0; i < ONSET_HISTORY; i++)
+        {
+            onsets[i] = m_onsets[(m_hops + i) % ONSET_HISTORY];
+            mean += onsets[i];
+        }
+        mean /= ONSET_HISTORY;
+        for (float & onset : onsets)
+            onset -= mean;
+
+        double hop_rate = (double) m_rate / ONSET_HOP;
+        int min_lag = floor (hop_rate * 60 / MAX_BPM);
+        int max_lag = ceil (hop_rate * 60 / MIN_BPM);
+        double lag_120 = hop_rate / 2;
+
+        double energy = correlate (onsets, 0);
+        double best_score = 0, best_correlation = 0;
+        int best_lag = 0;
+        for (int lag = min_lag; lag <= max_lag; lag ++)
+        {
+            double correlation = correlate (onsets, lag);
+            /* prefer tempos around 120 BPM so that neither half nor double
+             * the actual tempo wins */
+            double octaves = log2 (lag / lag_120);
+            double score = correlation * exp (-0.5 * octaves * octaves);
+            if (score > best_score)
+            {
+                best_score = score;
+                best_correlation = correlation;
+                best_lag = lag;
+            }
+        }
+
+        // give up on signals without a clear periodicity
+        if (best_lag == 0 || energy <= 0 || best_correlation < 0.1 * energy)
+        {
+            m_period = 0;
+            return;
+        }
+
+        // refine the lag by parabolic interpolation
+        double lag = best_lag;
+        if (best_lag > min_lag && best_lag < max_lag)
+        {
+            double left = correlate (onsets, best_lag - 1);
+            double right = correlate (onsets, best_lag + 1);
+            double curvature = left - 2 * best_correlation + right;
+            if (curvature < 0)
+                lag += 0.5 * (left - right) / curvature;
+        }
+
+        // find the beat phase which collects the most onset strength
+        double best_phase_score = -INFINITY;
+        int best_phase = 0;
+        for (int phase = 0; phase < best_lag; phase ++)
+        {
+            double score = 0;
+            for (double i = ONSET_HISTORY - 1 - phase; i >= 0; i -= lag)
+                score += onsets[(int) i];
+
+            if (score > best_phase_score)
+            {
+                best_phase_score = score;
+                best_phase = phase;
+            }
+        }
+
+        // a frame's onset is attributed to the center of the frame
+        uint64_t last_hop = m_hops - 1 - best_phase;
+        m_period = lag * ONSET_HOP;
+        m_beat = m_start + (last_hop + 1) * ONSET_HOP - ONSET_FFT_SIZE / 2;
+    }
+
+    static double correlate (const float * onsets, int lag)
+    {
+        double sum = 0;
+        for (int i = lag; i < ONSET_HISTORY; i++)
+            sum += onsets[i] * onsets[i - lag];
+        return sum / (ONSET_HISTORY - lag);
+    }
+
+    Fft<ONSET_FFT_SIZE> m_fft;
+    float m_frame[ONSET_FFT_SIZE];
+    float m_re[ONSET_FFT_SIZE], m_im[ONSET_FFT_SIZE];
+    float m_last_spectrum[ONSET_FFT_SIZE / 2];
+    float m_onsets[ONSET_HISTORY];
+    uint64_t m_start;
+    uint64_t m_hops;
+    int m_rate;
+    int m_pending;
+    double m_period, m_beat;
+};
+
+// whether fades shall end on a detected beat; mirrors the config DB
+static std::atomic<bool> beat_align_enabled (false);
+// the decimated mono audio from the audio thread to the beat tracker
+static SampleRing<ONSET_RING_SIZE> onset_ring;
+// the sample rate of the audio in onset_ring; 0 if there is no stream
+static std::atomic<int> onset_rate (0);
+// set (by any thread) in order to make the beat tracker start over
+static std::atomic<bool> onset_reset (true);
+// the results of the beat tracker; see BeatTracker::period () and beat ()
+static std::atomic<double> beat_period (0);
+static std::atomic<double> beat_position (0);
+// set while a beat tracking job is queued or running; there is at most one
+static std::atomic<bool> beat_tracking_queued (false);
+
+/* The state of downmixing and decimating a stream for the beat tracker: the
+ * decimation factor, and the number and sum of the samples of the current
+ * decimated sample so far. */
+struct OnsetDecimation
+{
+    int factor = 1;
+    int count = 0;
+    float sum = 0;
+};
+
+/* an analysis job which runs the beat tracker on the audio which process()
+ * provided via onset_ring so far */
+static void track_beats (void * data)
+{
+    static BeatTracker tracker;
+    float samples[ONSET_HOP];
+
+    if (onset_reset.exchange (false))
+    {
+        onset_ring.discard ();
+        tracker.reset (onset_ring.read (), onset_rate.load ());
+        beat_period.store (0);
+    }
+
+    int count;
+    while ((count = onset_ring.pop (samples, ONSET_HOP)) > 0)
+    {
+        tracker.analyze (samples, count);
+        analysis_yield ();
+    }
+
+    beat_position.store (tracker.beat ());
+    beat_period.store (tracker.period ());
+
+    beat_tracking_queued.store (false);
+}
+
+static void drop_beat_tracking (void * data)
+{
+    beat_tracking_queued.store (false);
+}
+
+/* Feeds the beat tracker with a downmixed and decimated copy of the given
+ * interleaved samples. Gives up on the samples if the tracker cannot keep up;
+ * it then restarts with the next block. */
+static void feed_beat_tracker (const float * data, int samples, int channels,
+    OnsetDecimation & decimation)
+{
+    float decimated[256];
+    int count = 0;
+
+    for (int i = 0; i < samples; i += channels)
+    {
+        for (int c = 0; c < channels; c++)
+            decimation.sum += data[i + c];
+
+        if (++ decimation.count < decimation.factor)
+            continue;
+
+        decimated[count ++] = decimation.sum / (decimation.factor * channels);
+        decimation.count = 0;
+        decimation.sum = 0;
+
+        if (count == aud::n_elems (decimated))
+        {
+            if (! onset_ring.push (decimated, count))
+                onset_reset.store (true);
+            count = 0;
+        }
+    }
+
+    if (count > 0 && ! onset_ring.push (decimated, count))
+        onset_reset.store (true);
+
+    if (onset_ring.written () - onset_ring.read () >= ONSET_JOB_SAMPLES &&
+        ! beat_tracking_queued.exchange (true))
+    {
+        submit_analysis ({track_beats, drop_beat_tracking, NULL});
+    }
+}
+
+/* Updates beat_align_enabled from the config DB. */
+static void beat_align_changed_cb ()
+{
+    beat_align_enabled.store (aud_get_bool (AUD_CFG_SECTION,
+        AUD_CFG_KEY_BEAT_ALIGN));
+    onset_reset.store (true);
+}
+
+static int current_output_delay_ms ();
+
+/* Stretches or shrinks the given fade duration (in seconds) so that the fade
+ * ends on a beat, if beat alignment is enabled and a beat grid is known. */
+static double align_duration_to_beat (double duration)
+{
+    double period = beat_period.load ();
+    int rate = onset_rate.load ();
+    if (! beat_align_enabled.load () || period <= 0 || rate <= 0)
+        return duration;
+
+    // the onsets are detected ahead of the output (e.g., of the lookahead)
+    double now = onset_ring.written () -
+        (double) current_output_delay_ms () * rate / 1000;
+    double beat = beat_position.load ();
+    if (now - beat > MAX_BEAT_AGE * rate)
+        return duration;
+
+    // the beat closest to the regular end of the fade
+    double end = now + duration * rate;
+    double aligned = beat + round ((end - beat) / period) * period;
+    if (aligned - now < rate)
+        aligned += period;
+    else if (aligned - now > MAX_DURATION * rate)
+        aligned -= period;
+
+    double aligned_duration = aud::clamp ((aligned - now) / rate, 1.0,
+        (double) MAX_DURATION);
+    AUDDBG ("Aligned fade duration %.2f s to %.2f s (%.1f BPM)\n", duration,
+        aligned_duration, 60 * rate / period);
+
+    return aligned_duration;
+}
+
+/* The slots of the envelope compositor: fading out (or a fade sequence),
+ * ducking from the menu and ducking for the sidechain. */
+enum EnvelopeSlot
+{
+    FadeSlot,
+    DuckSlot,
+    SidechainSlot,
+    ENVELOPE_SLOTS
+};
+
+/* What the envelope of the fade slot is currently used for. */
+enum class FadeState
+{
+    Idle,
+    FadingOut,
+    Faded,
+    Sequencing,
+    // a fade sequence ended below full volume
+    Held,
+    Restoring
+};
+
+/* A command for the gain envelopes, sent from the main to the audio thread. */
+struct FadeCommand
+{
+    enum Action {FadeOut, Duck, Restore, Reset, Unschedule, Quit, Sequence,
+        Cancel} action;
+    // the length (in seconds) and target gain of the ramp
+    float seconds, gain;
+    // whether a fade-out continues with the next song instead of stopping
+    bool to_next_song;
+    /* when a fade-out (or which fade-out to unschedule) starts: right away,
+     * at a wall-clock time (as of g_get_real_time ()) or at a position of the
+     * current song (in milliseconds) */
+    enum Schedule {Now, AtTime, AtPosition} schedule;
+    int64_t at;
+    /* whether a fade-out stops playback as its song ends even if fade-outs
+     * continue across songs (e.g., if the song is shorter than reported) */
+    bool stop_at_finish;
+};
+
+/* Returns the clock by which a fade-out with the given schedule starts. */
+static FadeClock schedule_clock (FadeCommand::Schedule schedule)
+{
+    return (schedule == FadeCommand::AtTime) ? FadeClock::WallClock :
+        FadeClock::SongPosition;
+}
+
+/* A step of a fade sequence, which the audio thread carries out one after
+ * another: fading out or in, playing on for some time, skipping to the next
+ * song (and waiting for it to start), or stopping playback. */
+struct FadeStep
+{
+    enum Kind {Out, In, Play, Next, Stop} kind;
+    // the length of a fade or of playing on (in seconds)
+    float seconds;
+};
+
+// the gain at the end of a fade-out of the current song; set by the main
+// thread as a song starts
+static std::atomic<float> song_fade_floor (FADE_FLOOR);
+// whether fade-outs of stereo songs collapse the side channel first
+static std::atomic<bool> width_fade_enabled (false);
+// whether fade-outs end in echoes, and their delay (in ms)
+static std::atomic<bool> echo_out_enabled (false);
+static std::atomic<int> echo_delay_ms (375);
+// whether fade-outs take high frequencies away before low ones
+static std::atomic<bool> spectral_fade_enabled (false);
+// whether fade-outs slow the tempo down
+static std::atomic<bool> ritardando_enabled (false);
+// whether fade-outs continue into the next song rather than stopping with the
+// current one
+static std::atomic<bool> fade_across_songs (false);
+
+/* How a stream is used: not at all yet (or since the plugin was enabled),
+ * for playing a song, waiting for the next song of the playlist (which
+ * follows gaplessly, possibly from another audio thread), not anymore, as
+ * playback stopped, or not anymore as far as the main thread can tell, as its
+ * audio thread stopped processing in the middle of a song. */
+enum class StreamUse {Unused, Playing, Continuing, Ended, Retired};
+
+/* The state of the audio thread for one stream, i.e., everything that is
+ * touched for each block of audio, along with what links it to the main
+ * thread. It is bound to the audio thread processing the stream by start (),
+ * and aligned to a cache line so that the states of different streams never
+ * share one. */
+struct alignas (64) FadeStream
+{
+    void start (int channels, int rate, StreamUse previous);
+    Index<float> & process (Index<float> & data, bool draining = false);
+    void flush ();
+    Index<float> & finish (Index<float> & data, bool end_of_playlist);
+    void stop_playback (bool to_next_song);
+
+    GainEnvelope & fade_envelope ()
+        { return envelopes.slot (FadeSlot); }
+
+    void reset_fades ();
+    void drop_fade_sequence ();
+    void next_sequence_step ();
+    void begin_fade_out (const FadeCommand & command);
+    void begin_echo (double seconds);
+    void run_fade_commands ();
+    void fade_ramp_finished ();
+    float fade_progress ();
+    int render (float * data, int frames, int64_t position);
+    void apply_width (float * data, int samples, int channels);
+    void apply_envelope (float * data, int samples, int channels);
+    void mix_echo (float * data, int samples, int channels);
+    void measure_profile (const float * data, int samples);
+    void submit_profile (int length_ms);
+
+    /* How the stream is used, the number of times it was bound to an audio
+     * thread, and when it processed audio the last time (in monotonic
+     * time). */
+    std::atomic<StreamUse> use {StreamUse::Unused};
+    std::atomic<unsigned> claims {0};
+    std::atomic<int64_t> active_time {0};
+    // the commands and fade sequence steps sent by the main thread
+    BoundedQueue<FadeCommand, FADE_QUEUE_SIZE> commands;
+    BoundedQueue<FadeStep, FADE_SEQUENCE_SIZE> steps;
+    // the song position (in milliseconds) after a seek; -1 if there was none
+    std::atomic<int64_t> seek_position_ms {-1};
+    // set while a stop (or skip) requested by a finished fade-out is pending
+    std::atomic<bool> stop_pending {false};
+    std::atomic<bool> stop_to_next_song {false};
+    // set once the fade-out for quitting is done
+    std::atomic<bool> quit_done {false};
+    /* by how much the output lags behind the input altogether (in ms of the
+     * input), and the tempo at which the input comes out (below 1 while it is
+     * slowed down) */
+    std::atomic<int> output_delay_ms {0};
+    std::atomic<float> output_tempo {1};
+
+    // the number of interleaved channels and the sample rate of the stream
+    int stream_channels = 0;
+    int stream_rate = 0;
+    // the number of frames of the current song which have been processed
+    int64_t stream_frames = 0;
+    /* As seek positions come from the main thread, they might arrive before
+     * or after the stream is flushed for the seek: this is the position (in
+     * frames) from before the flush, or -1; and whether there was a flush
+     * which is still waiting for its position. */
+    int64_t seek_frames_pending = -1;
+    bool seek_flushed = false;
+
+    // the gain envelopes and what the one for fading is used for
+    EnvelopeCompositor<ENVELOPE_SLOTS> envelopes;
+    FadeState fade_state = FadeState::Idle;
+    bool fade_to_next_song = false;
+    bool fade_stops_at_finish = false;
+    // the gain of the side channel of stereo songs
+    GainEnvelope width_envelope;
+    // set while a fade-out is carried over from one song to the next
+    bool fade_carried = false;
+    // set while fading out for quitting, which ends without stopping playback
+    bool fade_quitting = false;
+    // set while a fade sequence waits for the next song to start
+    bool sequence_waiting = false;
+    // the fade-outs which wait for their start (by FadeCommand::Schedule; the
+    // first one is unused)
+    FadeScheduler<FadeCommand> scheduled_fades;
+
+    // the sidechain gain which the sidechain slot ramps (or has ramped) to
+    float sidechain_target = 1;
+
+    RampTable ramp_table, width_table;
+    GainSmoother smoother;
+
+    /* The lookahead ring, holding the latest lookahead_frames frames of the
+     * input, which have not been output yet, and whether it continues into
+     * the next song. */
+    DelayLine lookahead;
+    int lookahead_frames = 0;
+    bool lookahead_continues = false;
+    /* The number of frames of silence which are left out of the output at the
+     * start of a song since the end of the previous one was drained (the
+     * silence was delayed in its place, so the song follows without a gap). */
+    int withheld_frames = 0;
+    // the fade of high frequencies before low ones, and the slowing down
+    SpectralFade spectral;
+    TimeStretch stretch;
+    // by how many frames the output lags behind the input altogether
+    int delay_frames = 0;
+
+    /* The feedback delay line of echo-outs (allocated for MAX_ECHO_DELAY,
+     * its length is the current delay); whether echoes are being mixed in,
+     * and whether they are dying away after a cancelled fade-out; and their
+     * envelope. */
+    DelayLine echo_line;
+    bool echo_active = false;
+    bool echo_dying = false;
+    GainEnvelope echo_envelope;
+    RampTable echo_table;
+
+    /* The loudness measurement of the current song: whether it is running,
+     * the levels of the windows so far, the length of a window and the
+     * samples of the current one (and their sum of squares). */
+    bool profiling = false;
+    unsigned char profile_levels[MAX_PROFILE_WINDOWS];
+    int profile_windows = 0;
+    int64_t profile_window_samples = 0;
+    int64_t profile_samples = 0;
+    double profile_square_sum = 0;
+    /* the serial number of the song being profiled: the one of the last song
+     * at the start of the stream, until a newer one started playing (as
+     * "playback ready" might come just after the stream was started) */
+    int profile_serial = 0;
+    bool profile_serial_known = false;
+    // set from the main thread if the song was seeked, i.e., not profiled fully
+    std::atomic<bool> profile_invalid {false};
+
+    OnsetDecimation onset_decimation;
+};
+
+/* The plugin, which owns the streams: there is usually just one, but another
+ * plugin (e.g., for crossfading) might process two songs in different threads
+ * at the same time. The audio threads process their streams; the main thread
+ * reaches them through the plugin, which sends commands only to the streams
+ * which are playing. */
 class FadeoutPlugin : public EffectPlugin
 {
 public:
@@ -78,169 +1109,2259 @@ public:
         & fadeout_prefs
     };
 
-    constexpr FadeoutPlugin () : EffectPlugin (info, 9, true) {}
+    // not constexpr, as the streams are constructed along with the plugin
+    FadeoutPlugin () : EffectPlugin (info, 9, true) {}
 
     bool init ();
     void cleanup ();
 
     void start (int & channels, int & rate);
     Index<float> & process (Index<float> & data);
+    bool flush (bool force);
+    int adjust_delay (int delay);
     Index<float> & finish (Index<float> & data, bool end_of_playlist);
+
+    FadeStream * current_stream () const
+        { return current.load (std::memory_order_relaxed); }
+
+    bool processing ();
+    void send_fade_command (const FadeCommand & command);
+    void send_fade_steps (const Index<FadeStep> & steps);
+    bool quit_fades_done ();
+    void end_streams ();
+
+private:
+    FadeStream & bind_stream (StreamUse & previous);
+    bool stream_playing (FadeStream & stream, int64_t now);
+
+    FadeStream streams[MAX_STREAMS];
+    // the stream which started last, i.e., which plays the current song; only
+    // that one feeds the song analyses and the beat tracker
+    std::atomic<FadeStream *> current {nullptr};
 };
 
 EXPORT FadeoutPlugin aud_plugin_instance;
 
+// the stream processed by the calling audio thread, and the claim by which it
+// was bound (it is not the thread's anymore once it was claimed again)
+static thread_local FadeStream * bound_stream = nullptr;
+static thread_local unsigned bound_claim = 0;
 
-// the volume reduction; 1 for inactive fading; >1 for active fading
-static double vol_reduction = 1;
-// workaround used to more or less detect if the plugin is enabled or not
-static bool is_plugin_processing = false;
-
-/* a GSourceFunc which stops the audio playback and our fading thread (if it
- * should still be running); to be used in g_idle_add() for thread-safety */
-static gboolean stop_playback_and_fading_cb (gpointer data)
+/* Returns the stream processed by the calling thread, or nullptr. */
+static FadeStream * thread_stream ()
 {
-    aud_drct_stop ();
-    vol_reduction = 1;
+    if (bound_stream &&
+        bound_stream->claims.load (std::memory_order_relaxed) != bound_claim)
+        bound_stream = nullptr;
 
-    return FALSE;
+    return bound_stream;
 }
 
-/* stops the audio playback and our fading thread (if it should still be
- * running) */
-static void stop_playback_and_fading ()
+/* Returns how much a stream is preferred for a new song: the one which waits
+ * for the next song comes first, then one which is not used anymore (as it
+ * probably played the previous song), then an unused one and one which was
+ * abandoned in the middle of a song (even if it was not retired yet); one
+ * which is busy playing is taken over only if all of them are. */
+static int stream_preference (const FadeStream & stream, int64_t now)
 {
-    // make sure to run this in the main loop in order to be thread-safe
-    g_idle_add (stop_playback_and_fading_cb, NULL);
+    switch (stream.use.load ())
+    {
+    case StreamUse::Continuing:
+        return 3;
+    case StreamUse::Ended:
+        return 2;
+    case StreamUse::Unused:
+    case StreamUse::Retired:
+        return 1;
+    default:
+        return (now - stream.active_time.load () > STREAM_IDLE_MS * 1000) ?
+            1 : 0;
+    }
 }
 
-/* Calculates the vol_reduction_amount from the configured number of seconds. */
-static double calculate_vol_reduction_amount ()
-{
-    double duration = aud_get_double (AUD_CFG_SECTION, AUD_CFG_KEY_DURATION);
-    // we have to multiply the seconds by 100 as we sleep 0,01 seconds in each
-    // volume reduction step in the fading thread
-    return pow (MAX_VOL_REDUCTION, (1 / (100 * duration)));
-}
+// held while an audio thread looks for a stream and claims it
+static std::atomic_flag binding_stream = ATOMIC_FLAG_INIT;
 
-/* Smoothly increases the volume reduction and finally stops playback. */
-static gpointer fading_thread (gpointer data)
+/* Returns the stream for the song which the calling audio thread starts, and
+ * how it was used before; a thread keeps its stream from song to song, and
+ * otherwise claims the one it prefers most (of those which were active, the
+ * latest one). */
+FadeStream & FadeoutPlugin::bind_stream (StreamUse & previous)
 {
-    double vol_reduction_amount = calculate_vol_reduction_amount ();
-    GTimer* timer = g_timer_new ();
-    guint16 target = 10000;
-    gint32 remaining = 0;
+    if (thread_stream ())
+    {
+        previous = bound_stream->use.exchange (StreamUse::Playing);
+        return * bound_stream;
+    }
+
+    // threads start songs rarely, and choosing takes no time
+    while (binding_stream.test_and_set (std::memory_order_acquire))
+        g_thread_yield ();
 
-    // fade out smoothly
-    for (vol_reduction *= vol_reduction_amount;
-         vol_reduction < MAX_VOL_REDUCTION;
-         vol_reduction *= vol_reduction_amount)
+    int64_t now = g_get_monotonic_time ();
+    FadeStream * best = nullptr;
+    int best_preference = -1;
+
+    for (FadeStream & stream : streams)
     {
-        /* We are targeting a sleep time of 10000 microseconds per loop
-         * iteration. For various reasons this time can be more or less,
-         * though, so we always keep track of the remaining total sleep time
-         * and adjust the next target accordingly. */
-        g_timer_start (timer);
-        g_usleep (target);
-        /* the time difference between our target time and the actually uslept
-         * time: if diff>0 then we have slept too long, if diff<0 then we have
-         * slept too few */
-        gint32 diff = (1000000.0 * g_timer_elapsed (timer, NULL)) - target;
-        /* overall, how much sleep time is still remaining? */
-        remaining = 10000 - diff + (remaining < 0 ? remaining : 0);
-        /* thus, what is the sleep time target for the next iteration? */
-        target = remaining < 0 ? 0 : remaining;
+        int preference = stream_preference (stream, now);
+        int64_t active = stream.active_time.load ();
+        bool better = (preference > best_preference);
+        if (preference == best_preference)
+        {
+            int64_t best_active = best->active_time.load ();
+            better = preference ? (active > best_active) :
+                (active < best_active);
+        }
 
-        /* if the volume reduction was set back outside this thread, then the
-         * plugin has shut down or the song is over and we also have to exit
-         * this thread */
-        if (vol_reduction == 1)
+        if (better)
         {
-            g_timer_destroy (timer);
-            g_thread_exit (NULL);
+            best = & stream;
+            best_preference = preference;
         }
     }
-    g_timer_destroy (timer);
 
-    // the volume is low enough now -- stop playback
-    stop_playback_and_fading ();
+    if (! best_preference)
+        AUDWARN ("Too many streams, taking over the one idle longest.\n");
 
-    // the fading is inactive now
-    vol_reduction = 1;
+    previous = best->use.exchange (StreamUse::Playing);
+    best->active_time.store (now);
+    bound_claim = best->claims.fetch_add (1) + 1;
+    bound_stream = best;
 
-    return NULL;
+    binding_stream.clear (std::memory_order_release);
+    return * best;
 }
 
-/* Callback function for invoking the fade out menu item. */
-static void fade_out_cb ()
+/* Returns whether the given stream is playing a song; one which has not
+ * processed any audio for longer than its output delay (and STREAM_IDLE_MS)
+ * without being paused was abandoned in the middle of a song, so it is
+ * retired. Called from the main thread. */
+bool FadeoutPlugin::stream_playing (FadeStream & stream, int64_t now)
 {
-    // only fade out if the plugin is processing and fading is not yet active
-    if (is_plugin_processing && vol_reduction == 1)
-    {
-        GError * error = NULL;
-        GThread * thread = g_thread_try_new (
-            NULL, (GThreadFunc) fading_thread, NULL, &error);
-        g_thread_unref (thread);
+    if (stream.use.load () != StreamUse::Playing)
+        return false;
 
-        if (error != NULL)
-        {
-            g_warning (_("Could not create the thread for fading out: %s"),
-                error->message);
-            g_error_free (error);
-        }
-    }
+    int64_t idle = now - stream.active_time.load ();
+    int64_t delay = stream.output_delay_ms.load () + STREAM_IDLE_MS;
+    if (idle <= delay * 1000 || aud_drct_get_paused ())
+        return true;
 
-    return;
+    StreamUse playing = StreamUse::Playing;
+    if (stream.use.compare_exchange_strong (playing, StreamUse::Retired))
+        AUDDBG ("Retiring a stream which stopped processing.\n");
+
+    return false;
 }
 
-bool FadeoutPlugin::init ()
+/* Returns whether any stream is playing a song; a workaround used to more or
+ * less detect if the plugin is enabled or not. */
+bool FadeoutPlugin::processing ()
 {
-    aud_config_set_defaults (AUD_CFG_SECTION, fadeout_defaults);
-
-    // create the menu item and connect it to a callback function
-    aud_plugin_menu_add (AudMenuID::Main, fade_out_cb, _("Fade out"), NULL);
+    int64_t now = g_get_monotonic_time ();
+    bool playing = false;
+    for (FadeStream & stream : streams)
+        playing = stream_playing (stream, now) || playing;
 
-    return true;
+    return playing;
 }
 
-void FadeoutPlugin::cleanup ()
+/* Returns by how much the output of the current stream lags behind its
+ * input (in ms). */
+static int current_output_delay_ms ()
 {
-    // switch off the fading thread
-    vol_reduction = 1;
-
-    aud_plugin_menu_remove (AudMenuID::Main, fade_out_cb);
+    FadeStream * stream = aud_plugin_instance.current_stream ();
+    return stream ? stream->output_delay_ms.load () : 0;
 }
 
-void FadeoutPlugin::start (int & channels, int & rate)
+/* Sends a command to the audio threads, i.e., to each stream which is playing
+ * (an idle one would only carry it out for the next song); called from the
+ * main thread. */
+void FadeoutPlugin::send_fade_command (const FadeCommand & command)
 {
-    is_plugin_processing = true;
+    int64_t now = g_get_monotonic_time ();
+    for (FadeStream & stream : streams)
+    {
+        if (! stream_playing (stream, now))
+            continue;
+
+        if (command.action == FadeCommand::Quit)
+            stream.quit_done.store (false);
+        if (! stream.commands.push (command))
+            AUDWARN ("Too many pending fade commands, dropping one.\n");
+    }
 }
 
-Index<float> & FadeoutPlugin::process (Index<float> & data)
+/* Queues the steps of a fade sequence for each stream which is playing (the
+ * sequence itself is started by a command); called from the main thread. */
+void FadeoutPlugin::send_fade_steps (const Index<FadeStep> & steps)
 {
-    // adjust the volume only if fading is active
-    if (vol_reduction != 1)
+    int64_t now = g_get_monotonic_time ();
+    for (FadeStream & stream : streams)
     {
-        float * end = data.end ();
-        for (float * f = data.begin (); f < end; f++)
+        if (! stream_playing (stream, now))
+            continue;
+
+        for (const FadeStep & step : steps)
         {
-            * f = * f / vol_reduction;
+            if (! stream.steps.push (step))
+            {
+                AUDWARN ("Too many queued fade sequence steps, dropping the "
+                    "rest.\n");
+                break;
+            }
         }
     }
+}
 
-    return data;
+/* Returns whether the fade-outs for quitting are done in all streams which
+ * are playing. */
+bool FadeoutPlugin::quit_fades_done ()
+{
+    int64_t now = g_get_monotonic_time ();
+    for (FadeStream & stream : streams)
+    {
+        if (stream_playing (stream, now) && ! stream.quit_done.load ())
+            return false;
+    }
+
+    return true;
 }
 
-Index<float> & FadeoutPlugin::finish (Index<float> & data, bool end_of_playlist)
+/* Lets no stream go on with another song, as playback stopped. */
+void FadeoutPlugin::end_streams ()
 {
-    // make sure to stop with the current song if fading is active
-    if (vol_reduction != 1)
+    for (FadeStream & stream : streams)
     {
-        stop_playback_and_fading ();
+        if (stream.use.load () != StreamUse::Unused)
+            stream.use.store (StreamUse::Ended);
+    }
+}
+
+/* a GSourceFunc which stops the audio playback, or skips to the next song
+ * after an automatic fade; to be used in g_idle_add() with the stream which
+ * requested it, for thread-safety */
+static gboolean stop_playback_cb (gpointer data)
+{
+    FadeStream * stream = (FadeStream *) data;
+
+    // the song might have ended on its own in the meantime
+    if (! stream->stop_pending.exchange (false))
+        return FALSE;
+
+    log_channel_levels ();
+
+    if (stream->stop_to_next_song.load ())
+        aud_drct_pnext ();
+    else
+        aud_drct_stop ();
+
+    return FALSE;
+}
+
+/* stops the audio playback (or skips to the next song) after a fade-out */
+void FadeStream::stop_playback (bool to_next_song)
+{
+    stop_to_next_song.store (to_next_song);
+    stop_pending.store (true);
+    // make sure to run this in the main loop in order to be thread-safe
+    g_idle_add (stop_playback_cb, this);
+}
+
+/* Switches off any fading; called from the audio thread. */
+void FadeStream::reset_fades ()
+{
+    envelopes.reset ();
+    fade_state = FadeState::Idle;
+    fade_carried = false;
+    fade_quitting = false;
+    scheduled_fades.clear ();
+    drop_fade_sequence ();
+}
+
+/* Discards the remaining steps of a fade sequence; called from the audio
+ * thread. */
+void FadeStream::drop_fade_sequence ()
+{
+    FadeStep step;
+    while (steps.pop (step))
+        ;
+    sequence_waiting = false;
+}
+
+/* Starts the next step of a fade sequence, or ends the sequence if there is
+ * none; called from the audio thread once the previous step is done. */
+void FadeStream::next_sequence_step ()
+{
+    FadeStep step;
+    if (! steps.pop (step))
+    {
+        // a sequence which ends silent can be restored like a duck
+        fade_state = (fade_envelope ().gain () < 1) ? FadeState::Held :
+            FadeState::Idle;
+        return;
+    }
+
+    fade_state = FadeState::Sequencing;
+
+    switch (step.kind)
+    {
+    case FadeStep::Out:
+        fade_envelope ().ramp_to (song_fade_floor.load (), step.seconds);
+        break;
+
+    case FadeStep::In:
+        fade_envelope ().ramp_to (1, step.seconds);
+        break;
+
+    case FadeStep::Play:
+        // a ramp to the same gain, which ends at the exact frame
+        fade_envelope ().ramp_to (fade_envelope ().gain (), step.seconds);
+        break;
+
+    case FadeStep::Next:
+        // the envelope stays as it is until start () of the next song
+        sequence_waiting = true;
+        stop_playback (true);
+        break;
+
+    case FadeStep::Stop:
+        drop_fade_sequence ();
+        fade_state = FadeState::Faded;
+        fade_to_next_song = false;
+        stop_playback (false);
+        break;
+    }
+
+    // a zero-length step is done right away
+    if (fade_state == FadeState::Sequencing && ! sequence_waiting &&
+        ! fade_envelope ().ramping ())
+        next_sequence_step ();
+}
+
+/* Starts ramping the envelope down to the floor unless that happens already;
+ * called from the audio thread. A fade sequence is cut short. */
+void FadeStream::begin_fade_out (const FadeCommand & command)
+{
+    if (fade_state == FadeState::Sequencing)
+        drop_fade_sequence ();
+
+    if (fade_state != FadeState::FadingOut && fade_state != FadeState::Faded)
+    {
+        // the song itself fades out faster, leaving its echoes ringing
+        double seconds = command.seconds;
+        if (echo_out_enabled.load () && echo_line.capacity ())
+        {
+            begin_echo (command.seconds);
+            seconds *= ECHO_DRY_SHARE;
+        }
+
+        fade_envelope ().ramp_to (song_fade_floor.load (), seconds);
+        fade_state = FadeState::FadingOut;
+        fade_to_next_song = command.to_next_song;
+        fade_stops_at_finish = command.stop_at_finish;
+
+        if (stream_channels == 2 && width_fade_enabled.load ())
+        {
+            width_envelope.ramp_to (FADE_FLOOR,
+                command.seconds * WIDTH_FADE_SHARE);
+        }
+    }
+}
+
+/* Starts the echoes of an echo-out, which die away within the given time (in
+ * seconds). Their delay is one beat if a beat grid is known (halved until it
+ * fits into the delay line), and the configured one otherwise. */
+void FadeStream::begin_echo (double seconds)
+{
+    double delay = echo_delay_ms.load () / 1000.0;
+    double period = beat_period.load ();
+    int rate = onset_rate.load ();
+    if (beat_align_enabled.load () && period > 0 && rate > 0)
+    {
+        delay = period / rate;
+        while (delay > MAX_ECHO_DELAY / 1000.0)
+            delay /= 2;
+    }
+
+    // nothing of earlier echoes may come back
+    int frames = aud::clamp ((int) (delay * stream_rate), 1,
+        echo_line.capacity () / stream_channels);
+    echo_line.set_length (frames * stream_channels);
+
+    echo_envelope.set (1);
+    echo_envelope.ramp_to (FADE_FLOOR, seconds);
+    echo_active = true;
+    echo_dying = false;
+}
+
+/* Carries out the commands which were sent to the audio thread. */
+void FadeStream::run_fade_commands ()
+{
+    FadeCommand command;
+    while (commands.pop (command))
+    {
+        bool fading_out = (fade_state == FadeState::FadingOut ||
+            fade_state == FadeState::Faded ||
+            fade_state == FadeState::Sequencing);
+
+        switch (command.action)
+        {
+        case FadeCommand::FadeOut:
+            if (command.schedule != FadeCommand::Now)
+            {
+                scheduled_fades.schedule (schedule_clock (command.schedule),
+                    command.at, command);
+            }
+            else
+                begin_fade_out (command);
+            break;
+
+        case FadeCommand::Duck:
+            envelopes.slot (DuckSlot).ramp_to (command.gain, command.seconds);
+            break;
+
+        case FadeCommand::Restore:
+            envelopes.slot (DuckSlot).ramp_to (1, command.seconds);
+            if (fade_state == FadeState::Held)
+            {
+                fade_envelope ().ramp_to (1, command.seconds);
+                fade_state = FadeState::Restoring;
+            }
+            break;
+
+        case FadeCommand::Reset:
+            reset_fades ();
+            break;
+
+        case FadeCommand::Sequence:
+            /* steps which are queued while a sequence runs are appended to it,
+             * but a fade-out must not be interrupted */
+            if (! fading_out)
+                next_sequence_step ();
+            else if (fade_state != FadeState::Sequencing)
+                drop_fade_sequence ();
+            break;
+
+        case FadeCommand::Cancel:
+            drop_fade_sequence ();
+            if (fade_state == FadeState::Sequencing ||
+                fade_state == FadeState::Held)
+            {
+                fade_envelope ().ramp_to (1, command.seconds);
+                fade_state = FadeState::Restoring;
+            }
+            break;
+
+        case FadeCommand::Quit:
+            // takes over any fade-out (or sequence) which is running already
+            drop_fade_sequence ();
+            fade_carried = false;
+            fade_quitting = true;
+            fade_stops_at_finish = false;
+            scheduled_fades.clear ();
+
+            if (echo_active)
+            {
+                echo_envelope.ramp_to (FADE_FLOOR, command.seconds);
+                echo_dying = true;
+            }
+
+            if (fade_state == FadeState::Faded)
+                quit_done.store (true);
+            else
+            {
+                fade_envelope ().ramp_to (song_fade_floor.load (),
+                    command.seconds);
+                fade_state = FadeState::FadingOut;
+            }
+            break;
+
+        case FadeCommand::Unschedule:
+            scheduled_fades.cancel (schedule_clock (command.schedule));
+            break;
+        }
+    }
+}
+
+/* Called from the audio thread when a ramp of the fade slot has ended. */
+void FadeStream::fade_ramp_finished ()
+{
+    switch (fade_state)
+    {
+    case FadeState::FadingOut:
+        // let the echoes of an echo-out ring out first
+        if (echo_active && ! fade_quitting)
+            break;
+
+        // the volume is low enough now -- stop playback (unless quitting, as
+        // that stops it anyway)
+        fade_state = FadeState::Faded;
+        if (fade_quitting)
+            quit_done.store (true);
+        else
+            stop_playback (fade_to_next_song);
+        break;
+
+    case FadeState::Restoring:
+        fade_state = FadeState::Idle;
+        break;
+
+    case FadeState::Sequencing:
+        next_sequence_step ();
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* The result of analyzing the loudness profile of a song. */
+struct SongAnalysis
+{
+    // identification of the analyzed version of the song file
+    int64_t mtime, size;
+    int length_ms;
+    // the mean loudness of the non-silent parts of the song in dBFS
+    float loudness;
+    // where the outro starts, i.e., where the song stops being at full level
+    int outro_ms;
+    // where a fade-out should start in order to end with the audible song
+    int fade_ms;
+    // the loudness of each PROFILE_WINDOW_MS window in steps of -0.5 dBFS
+    Index<unsigned char> profile;
+};
+
+/* A song which started playing; needed for matching a measured loudness
+ * profile to the song file it was measured for. */
+struct PlayingSong
+{
+    int serial = 0;
+    String uri;
+    int64_t mtime = -1, size = -1;
+    int length_ms = -1;
+};
+
+/* A loudness profile as measured by the audio thread for a whole song. */
+struct MeasuredProfile
+{
+    int serial;
+    int length_ms;
+    Index<unsigned char> profile;
+};
+
+/* A song analysis which is being done in the background. */
+struct SongAnalysisJob
+{
+    String uri;
+    double fade_duration;
+    SongAnalysis analysis;
+};
+
+// whether analyzed songs shall be faded out automatically; mirrors the config
+static std::atomic<bool> auto_fade_enabled (false);
+// the song position (in ms) at which to fade out automatically; -1 for never
+static std::atomic<int> auto_fade_ms (-1);
+// the analyzed songs by URI; only accessed from the main thread
+static SimpleHash<String, SongAnalysis> song_analyses;
+// the last two songs that started playing, the current one first
+static PlayingSong playing_songs[2];
+// the serial number of the song that started playing last; only written by
+// the main thread
+static std::atomic<int> playing_song_serial (0);
+
+/* Quantizes a level in dBFS for a loudness profile. */
+static unsigned char encode_profile_level (double db)
+{
+    return aud::clamp (lround (-2 * db), 0l, 255l);
+}
+
+static double decode_profile_level (unsigned char level)
+{
+    return -0.5 * level;
+}
+
+/* Finds the loudness, outro and suggested fade-out position of a song. */
+static void analyze_profile (SongAnalysis & analysis, double fade_duration)
+{
+    const Index<unsigned char> & profile = analysis.profile;
+    int windows = profile.len ();
+
+    // average the power of all non-silent windows
+    double power = 0;
+    int loud_windows = 0;
+    for (unsigned char level : profile)
+    {
+        double db = decode_profile_level (level);
+        if (db > SILENCE_LEVEL)
+        {
+            power += pow (10, db / 10);
+            loud_windows ++;
+        }
+    }
+
+    analysis.loudness = loud_windows ? 10 * log10 (power / loud_windows) :
+        SILENCE_LEVEL;
+
+    /* Walk back from the end over a smoothed version of the profile: the song
+     * is audible until the last non-silent window and it is at full level
+     * until the last window which is at most 6 dB below the mean loudness. */
+    int audible_end = 0, outro_start = 0;
+    for (int i = windows - 1; i >= 0 && ! outro_start; i--)
+    {
+        double db = 0;
+        int count = 0;
+        int last = aud::min (i + 1, windows - 1);
+        for (int j = aud::max (i - 1, 0); j <= last; j++)
+        {
+            db += decode_profile_level (profile[j]);
+            count ++;
+        }
+        db /= count;
+
+        if (! audible_end && db > SILENCE_LEVEL)
+            audible_end = i + 1;
+        if (db >= analysis.loudness - 6)
+            outro_start = i + 1;
+    }
+
+    analysis.outro_ms = aud::min (outro_start * PROFILE_WINDOW_MS,
+        analysis.length_ms);
+    /* let the fade end with the audible part of the song, but do not start it
+     * after the outro began */
+    analysis.fade_ms = aud::clamp ((int) (audible_end * PROFILE_WINDOW_MS -
+        fade_duration * 1000), 0, analysis.outro_ms);
+}
+
+/* Finds the file modification time and size of the song with the given URI;
+ * only works for local files. */
+static bool stat_song (const char * uri, int64_t & mtime, int64_t & size)
+{
+    char * path = g_filename_from_uri (uri, NULL, NULL);
+    if (! path)
+        return false;
+
+    struct stat info;
+    bool found = (stat (path, & info) == 0);
+    g_free (path);
+
+    if (found)
+    {
+        mtime = info.st_mtime;
+        size = info.st_size;
+    }
+
+    return found;
+}
+
+static StringBuf analysis_cache_path ()
+{
+    return filename_build ({aud_get_path (AudPath::UserDir),
+        ANALYSIS_CACHE_FILE});
+}
+
+/* Appends one song analysis to the given cache file; returns whether it was
+ * written. Each line has the form "mtime size length loudness outro fade
+ * profile uri" where the profile is written as hex digits (two per window).
+ * Only the main thread writes to the cache, so lines cannot interleave. */
+static bool write_analysis (VFSFile & file, const char * uri,
+    const SongAnalysis & analysis)
+{
+    StringBuf line = str_printf ("%lld %lld %d %.1f %d %d ",
+        (long long) analysis.mtime, (long long) analysis.size,
+        analysis.length_ms, analysis.loudness, analysis.outro_ms,
+        analysis.fade_ms);
+
+    for (unsigned char level : analysis.profile)
+    {
+        char digits[3];
+        snprintf (digits, sizeof digits, "%02x", level);
+        line.insert (-1, digits);
+    }
+    line.insert (-1, " ");
+    line.insert (-1, uri);
+    line.insert (-1, "\n");
+
+    return file.fwrite (line, 1, line.len ()) == line.len ();
+}
+
+/* Loads the cached song analyses; later entries replace earlier ones for the
+ * same song. Rewrites the cache file if it contains too many outdated
+ * entries. */
+static void load_analysis_cache ()
+{
+    StringBuf path = analysis_cache_path ();
+    VFSFile file (filename_to_uri (path), "r");
+    if (! file)
+        return;
+
+    Index<char> contents = file.read_all ();
+    contents.append (0);
+
+    int lines = 0;
+    for (char * line = contents.begin (), * next; * line; line = next)
+    {
+        char * end = strchr (line, '\n');
+        if (end)
+        {
+            * end = 0;
+            next = end + 1;
+        }
+        else
+            next = line + strlen (line);
+
+        SongAnalysis analysis;
+        long long mtime, size;
+        int profile_start = 0, profile_end = 0, uri_start = 0;
+        sscanf (line, "%lld %lld %d %f %d %d %n%*[0-9a-f]%n %n", & mtime,
+            & size, & analysis.length_ms, & analysis.loudness,
+            & analysis.outro_ms, & analysis.fade_ms, & profile_start,
+            & profile_end, & uri_start);
+        if (! uri_start)
+            continue;
+
+        analysis.mtime = mtime;
+        analysis.size = size;
+        for (int i = profile_start; i + 1 < profile_end; i += 2)
+        {
+            unsigned level;
+            sscanf (line + i, "%2x", & level);
+            analysis.profile.append (level);
+        }
+
+        song_analyses.add (String (line + uri_start), std::move (analysis));
+        lines ++;
+    }
+
+    // the compacted cache replaces the old one only once it is complete
+    if (lines > 2 * song_analyses.n_items ())
+    {
+        StringBuf temp_path = str_concat ({path, ".tmp"});
+        VFSFile temp (filename_to_uri (temp_path), "w");
+        bool written = (bool) temp;
+        song_analyses.iterate ([& written, & temp] (const String & uri,
+            SongAnalysis & analysis)
+        {
+            written = written && write_analysis (temp, uri, analysis);
+        });
+
+        if (written && temp.fflush () == 0)
+        {
+            temp = VFSFile ();
+            rename (temp_path, path);
+        }
+    }
+}
+
+/* a GSourceFunc which makes a finished song analysis available and appends it
+ * to the cache; to be used in g_idle_add() with a SongAnalysisJob */
+static gboolean add_song_analysis_cb (gpointer data)
+{
+    SongAnalysisJob * job = (SongAnalysisJob *) data;
+
+    VFSFile file (filename_to_uri (analysis_cache_path ()), "a");
+    if (! file || ! write_analysis (file, job->uri, job->analysis))
+        AUDWARN ("Cannot write to the song analysis cache.\n");
+
+    song_analyses.add (job->uri, std::move (job->analysis));
+    delete job;
+
+    return FALSE;
+}
+
+/* an analysis job which analyzes a SongAnalysisJob and hands the result over
+ * to the main thread */
+static void analyze_song (void * data)
+{
+    SongAnalysisJob * job = (SongAnalysisJob *) data;
+    SongAnalysis & analysis = job->analysis;
+    analyze_profile (analysis, job->fade_duration);
+
+    AUDDBG ("Analyzed %s: %.1f dBFS, outro at %d ms, fade at %d ms\n",
+        (const char *) job->uri, analysis.loudness, analysis.outro_ms,
+        analysis.fade_ms);
+
+    g_idle_add (add_song_analysis_cb, job);
+}
+
+static void drop_song_analysis (void * data)
+{
+    delete (SongAnalysisJob *) data;
+}
+
+/* a GSourceFunc which queues the analysis of a loudness profile that was
+ * measured for a whole song; to be used in g_idle_add() with a
+ * MeasuredProfile */
+static gboolean store_profile_cb (gpointer data)
+{
+    MeasuredProfile * measured = (MeasuredProfile *) data;
+
+    /* The song which the profile belongs to might already have been replaced
+     * by the next one, so look it up by its serial number (and make sure
+     * that the whole song was measured). */
+    for (const PlayingSong & song : playing_songs)
+    {
+        if (song.serial != measured->serial || song.mtime < 0 ||
+            song.length_ms <= 0 ||
+            abs (song.length_ms - measured->length_ms) > PROFILE_WINDOW_MS)
+            continue;
+
+        SongAnalysisJob * job = new SongAnalysisJob;
+        job->uri = song.uri;
+        job->fade_duration = aud_get_double (AUD_CFG_SECTION,
+            AUD_CFG_KEY_DURATION);
+        job->analysis.mtime = song.mtime;
+        job->analysis.size = song.size;
+        job->analysis.length_ms = song.length_ms;
+        job->analysis.profile = std::move (measured->profile);
+
+        submit_analysis ({analyze_song, drop_song_analysis, job});
+        break;
+    }
+
+    delete measured;
+    return FALSE;
+}
+
+/* Measures the (pre-fade) loudness profile of the current song; called from
+ * the audio thread. */
+void FadeStream::measure_profile (const float * data, int samples)
+{
+    if (! profile_serial_known)
+    {
+        int serial = playing_song_serial.load (std::memory_order_relaxed);
+        if (serial != profile_serial)
+        {
+            profile_serial = serial;
+            profile_serial_known = true;
+        }
+    }
+
+    for (int i = 0; i < samples; )
+    {
+        int count = aud::min ((int64_t) (samples - i),
+            profile_window_samples - profile_samples);
+        double sum = 0;
+        for (int end = i + count; i < end; i++)
+            sum += data[i] * data[i];
+
+        profile_square_sum += sum;
+        profile_samples += count;
+
+        if (profile_samples == profile_window_samples)
+        {
+            if (profile_windows < MAX_PROFILE_WINDOWS)
+                profile_levels[profile_windows ++] = encode_profile_level (
+                    10 * log10 (profile_square_sum / profile_samples));
+            else
+                profiling = false;
+
+            profile_samples = 0;
+            profile_square_sum = 0;
+        }
+    }
+}
+
+/* Hands the loudness profile of the song that just ended (after the given
+ * length) over to the main thread; called from the audio thread. */
+void FadeStream::submit_profile (int length_ms)
+{
+    if (! profiling || profile_invalid.load () || ! profile_windows)
+        return;
+
+    MeasuredProfile * measured = new MeasuredProfile;
+    measured->serial = profile_serial;
+    measured->length_ms = length_ms;
+    for (int i = 0; i < profile_windows; i++)
+        measured->profile.append (profile_levels[i]);
+    if (profile_samples > 0)
+        measured->profile.append (encode_profile_level (
+            10 * log10 (profile_square_sum / profile_samples)));
+
+    g_idle_add (store_profile_cb, measured);
+    profiling = false;
+}
+
+/* Updates auto_fade_enabled from the config DB. */
+static void auto_fade_changed_cb ()
+{
+    auto_fade_enabled.store (aud_get_bool (AUD_CFG_SECTION,
+        AUD_CFG_KEY_AUTO_FADE));
+}
+
+/* Updates width_fade_enabled from the config DB. */
+static void width_fade_changed_cb ()
+{
+    width_fade_enabled.store (aud_get_bool (AUD_CFG_SECTION,
+        AUD_CFG_KEY_WIDTH_FADE));
+}
+
+/* Updates lookahead_ms from the config DB; a change takes effect with the
+ * next song. */
+static void lookahead_changed_cb ()
+{
+    lookahead_ms.store (aud::clamp (aud_get_int (AUD_CFG_SECTION,
+        AUD_CFG_KEY_LOOKAHEAD), 0, MAX_LOOKAHEAD));
+}
+
+/* Updates echo_out_enabled and echo_delay_ms from the config DB; the delay
+ * line for echo-outs is only allocated (or freed) as the next song starts. */
+static void echo_changed_cb ()
+{
+    echo_out_enabled.store (aud_get_bool (AUD_CFG_SECTION,
+        AUD_CFG_KEY_ECHO_OUT));
+    echo_delay_ms.store (aud::clamp (aud_get_int (AUD_CFG_SECTION,
+        AUD_CFG_KEY_ECHO_DELAY), 1, MAX_ECHO_DELAY));
+}
+
+/* Updates spectral_fade_enabled from the config DB; a change takes effect
+ * with the next song. */
+static void spectral_fade_changed_cb ()
+{
+    spectral_fade_enabled.store (aud_get_bool (AUD_CFG_SECTION,
+        AUD_CFG_KEY_SPECTRAL_FADE));
+}
+
+/* Updates ritardando_enabled from the config DB; a change takes effect with
+ * the next song. */
+static void ritardando_changed_cb ()
+{
+    ritardando_enabled.store (aud_get_bool (AUD_CFG_SECTION,
+        AUD_CFG_KEY_RITARDANDO));
+}
+
+/* Updates fade_across_songs from the config DB. */
+static void across_songs_changed_cb ()
+{
+    fade_across_songs.store (aud_get_bool (AUD_CFG_SECTION,
+        AUD_CFG_KEY_ACROSS_SONGS));
+}
+
+/* Returns the fade floor for a song, given its analysis (if any): a song
+ * which plays quieter than the ReplayGain reference level becomes inaudible
+ * earlier, so its floor is raised by as much (and lowered for a louder one),
+ * keeping the perceived length of fades the same. The measured loudness
+ * already includes any ReplayGain adjustment by Audacious; without a
+ * measurement, a song's ReplayGain tag tells how loud it plays unless
+ * Audacious normalizes it anyway. */
+static float song_floor (const SongAnalysis * analysis)
+{
+    if (! aud_get_bool (AUD_CFG_SECTION, AUD_CFG_KEY_LEVEL_AWARE))
+        return FADE_FLOOR;
+
+    double offset = 0;
+    if (analysis && analysis->loudness > SILENCE_LEVEL)
+        offset = analysis->loudness - REFERENCE_LOUDNESS;
+    else if (! aud_get_bool (nullptr, "enable_replay_gain"))
+    {
+        Tuple tuple = aud_drct_get_tuple ();
+        if (tuple.get_value_type (Tuple::TrackGain) == Tuple::Int)
+            offset = - tuple.get_replay_gain ().track_gain;
+    }
+
+    offset = aud::clamp (offset, (double) - MAX_FLOOR_ADJUSTMENT,
+        (double) MAX_FLOOR_ADJUSTMENT);
+    AUDDBG ("Song plays %+.1f dB from the reference level.\n", offset);
+
+    return FADE_FLOOR * db_to_gain (- offset);
+}
+
+/* Hook function for "playback ready": makes the fade point of the song that
+ * started playing available to the audio thread if the song was analyzed
+ * before, as well as its fade floor. */
+static void playback_ready_cb (void * data, void * user)
+{
+    PlayingSong song;
+    song.serial = playing_song_serial.load () + 1;
+    song.uri = aud_drct_get_filename ();
+    song.length_ms = aud_drct_get_length ();
+    stat_song (song.uri, song.mtime, song.size);
+
+    playing_songs[1] = std::move (playing_songs[0]);
+    playing_songs[0] = song;
+    playing_song_serial.store (song.serial);
+
+    const SongAnalysis * analysis = song_analyses.lookup (song.uri);
+    if (analysis && (analysis->mtime != song.mtime ||
+        analysis->size != song.size))
+        analysis = nullptr;
+
+    auto_fade_ms.store (analysis ? analysis->fade_ms : -1);
+    song_fade_floor.store (song_floor (analysis));
+}
+
+/* Hook function for "playback seek". */
+static void playback_seek_cb (void * data, void * user)
+{
+    FadeStream * stream = aud_plugin_instance.current_stream ();
+    if (stream)
+    {
+        stream->profile_invalid.store (true);
+        stream->seek_position_ms.store (aud_drct_get_time ());
+    }
+}
+
+/* Hook function for "playback stop": no stream goes on with another song, and
+ * which thread plays the next one is up to Audacious. */
+static void playback_stop_cb (void * data, void * user)
+{
+    aud_plugin_instance.end_streams ();
+}
+
+/* Starts fading out unless the plugin is not processing (the audio thread
+ * ignores the request if fading out is already active); afterwards, either
+ * playback stops or the next song starts. */
+static void start_fading (bool to_next_song)
+{
+    if (aud_plugin_instance.processing ())
+    {
+        double duration = align_duration_to_beat (
+            aud_get_double (AUD_CFG_SECTION, AUD_CFG_KEY_DURATION));
+        aud_plugin_instance.send_fade_command ({FadeCommand::FadeOut,
+            (float) duration, 0, to_next_song});
+    }
+}
+
+/* a GSourceFunc which starts the automatic fade-out of an analyzed song; to be
+ * used in g_idle_add() from the audio thread */
+static gboolean auto_fade_cb (gpointer data)
+{
+    if (auto_fade_enabled.load ())
+        start_fading (true);
+
+    return FALSE;
+}
+
+/* Callback function for invoking the fade out menu item. */
+static void fade_out_cb ()
+{
+    start_fading (false);
+}
+
+/* Callback function for invoking the duck menu item. */
+static void duck_cb ()
+{
+    if (aud_plugin_instance.processing ())
+    {
+        double level = aud_get_double (AUD_CFG_SECTION, AUD_CFG_KEY_DUCK_LEVEL);
+        double seconds = aud_get_double (AUD_CFG_SECTION,
+            AUD_CFG_KEY_DUCK_DURATION);
+        aud_plugin_instance.send_fade_command ({FadeCommand::Duck,
+            (float) seconds, (float) db_to_gain (level), false});
+    }
+}
+
+// the ducking gain derived from the sidechain; written by the capture thread
+static std::atomic<float> sidechain_gain (1);
+// keeps the capture thread running as long as it is set
+static std::atomic<bool> sidechain_running (false);
+static GThread * sidechain_thread_handle = nullptr;
+// the main loop source which restarts the capture after a settings change
+static guint sidechain_restart_source = 0;
+
+/* The settings of the capture thread, read from the config DB. */
+struct SidechainSettings
+{
+    String source;
+    float threshold, duck_gain;
+    float attack, release;
+};
+
+/* Returns the coefficient of a one-pole filter with the given time constant
+ * (in milliseconds) at SIDECHAIN_RATE. */
+static float sidechain_coefficient (float ms)
+{
+    return exp (-1000 / (ms * SIDECHAIN_RATE));
+}
+
+/* Opens a sidechain source which is not an ALSA device, i.e., a file or a
+ * named pipe; does not block if no writer has opened the pipe yet. */
+static int open_sidechain_pipe (const char * path)
+{
+    int fd = open (path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        AUDERR ("Could not open the sidechain pipe %s: %s\n", path,
+            strerror (errno));
+
+    return fd;
+}
+
+/* Reads one period from a sidechain pipe; returns the number of frames read,
+ * 0 if there is nothing to read (yet) and -1 on errors. Waits for at most
+ * 100 ms, so that the capture thread can notice when it should stop. */
+static int read_sidechain_pipe (int fd, int16_t * frames)
+{
+    struct pollfd request = {fd, POLLIN, 0};
+    if (poll (& request, 1, 100) <= 0)
+        return 0;
+
+    ssize_t bytes = read (fd, frames, SIDECHAIN_PERIOD * sizeof (int16_t));
+    if (bytes < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (bytes == 0)
+    {
+        // no writer at the moment; do not spin until there is one again
+        g_usleep (100000);
+        return 0;
+    }
+
+    return bytes / sizeof (int16_t);
+}
+
+/* a GThreadFunc which reads the sidechain source, follows its level and
+ * publishes the resulting ducking gain in sidechain_gain */
+static gpointer sidechain_thread (gpointer data)
+{
+    SidechainSettings * settings = (SidechainSettings *) data;
+    const char * source = settings->source;
+    bool is_pipe = (source[0] == '/');
+
+    int fd = -1;
+#ifdef HAVE_ALSA
+    snd_pcm_t * pcm = nullptr;
+#endif
+
+    if (is_pipe)
+        fd = open_sidechain_pipe (source);
+    else
+    {
+#ifdef HAVE_ALSA
+        int error = snd_pcm_open (& pcm, source, SND_PCM_STREAM_CAPTURE, 0);
+        if (error >= 0)
+            error = snd_pcm_set_params (pcm, SND_PCM_FORMAT_S16,
+                SND_PCM_ACCESS_RW_INTERLEAVED, 1, SIDECHAIN_RATE, 1,
+                2 * SIDECHAIN_PERIOD * 1000000 / SIDECHAIN_RATE);
+        if (error < 0)
+        {
+            AUDERR ("Could not open the sidechain device %s: %s\n", source,
+                snd_strerror (error));
+            if (pcm)
+                snd_pcm_close (pcm);
+            pcm = nullptr;
+        }
+#else
+        AUDERR ("Cannot capture the sidechain device %s: the plugin was built "
+            "without ALSA support; use a named pipe instead\n", source);
+#endif
+    }
+
+    const float detect_attack = sidechain_coefficient (SIDECHAIN_DETECT_ATTACK);
+    const float detect_release =
+        sidechain_coefficient (SIDECHAIN_DETECT_RELEASE);
+    const float attack = sidechain_coefficient (settings->attack);
+    const float release = sidechain_coefficient (settings->release);
+    const float threshold = db_to_gain (settings->threshold) * 32768;
+
+    float level = 0, gain = 1;
+    int16_t frames[SIDECHAIN_PERIOD];
+
+    while (sidechain_running.load ())
+    {
+        int count = -1;
+        if (is_pipe && fd >= 0)
+            count = read_sidechain_pipe (fd, frames);
+#ifdef HAVE_ALSA
+        else if (pcm)
+        {
+            snd_pcm_sframes_t captured = snd_pcm_readi (pcm, frames,
+                SIDECHAIN_PERIOD);
+            if (captured < 0)
+                captured = snd_pcm_recover (pcm, captured, 1);
+            count = captured;
+        }
+#endif
+
+        if (count < 0)
+            break;
+
+        for (int i = 0; i < count; i++)
+        {
+            float x = fabsf (frames[i]);
+            level = x + (x > level ? detect_attack : detect_release) *
+                (level - x);
+
+            float target = (level > threshold) ? settings->duck_gain : 1;
+            float coefficient = (target < gain) ? attack : release;
+            gain = target + coefficient * (gain - target);
+        }
+
+        sidechain_gain.store (gain, std::memory_order_relaxed);
+    }
+
+    if (fd >= 0)
+        close (fd);
+#ifdef HAVE_ALSA
+    if (pcm)
+        snd_pcm_close (pcm);
+#endif
+
+    sidechain_gain.store (1);
+    delete settings;
+
+    return NULL;
+}
+
+static void stop_sidechain ()
+{
+    if (sidechain_thread_handle)
+    {
+        sidechain_running.store (false);
+        g_thread_join (sidechain_thread_handle);
+        sidechain_thread_handle = nullptr;
+    }
+}
+
+/* (Re)starts the capture thread with the current settings, if a source is
+ * configured. */
+static void start_sidechain ()
+{
+    stop_sidechain ();
+
+    String source = aud_get_str (AUD_CFG_SECTION, AUD_CFG_KEY_SIDECHAIN_SOURCE);
+    if (! source[0])
+        return;
+
+    SidechainSettings * settings = new SidechainSettings;
+    settings->source = source;
+    settings->threshold = aud_get_double (AUD_CFG_SECTION,
+        AUD_CFG_KEY_SIDECHAIN_THRESHOLD);
+    settings->duck_gain = db_to_gain (aud_get_double (AUD_CFG_SECTION,
+        AUD_CFG_KEY_DUCK_LEVEL));
+    settings->attack = aud::max (aud_get_double (AUD_CFG_SECTION,
+        AUD_CFG_KEY_SIDECHAIN_ATTACK), 1.0);
+    settings->release = aud::max (aud_get_double (AUD_CFG_SECTION,
+        AUD_CFG_KEY_SIDECHAIN_RELEASE), 1.0);
+
+    sidechain_running.store (true);
+    sidechain_thread_handle = g_thread_new (NULL,
+        (GThreadFunc) sidechain_thread, settings);
+}
+
+/* a GSourceFunc which restarts the capture once the settings were left alone
+ * for a while */
+static gboolean restart_sidechain_cb (gpointer data)
+{
+    sidechain_restart_source = 0;
+    start_sidechain ();
+    return FALSE;
+}
+
+/* Restarts the capture after the settings have changed; as the source is
+ * typed in (and the numbers may be spun through), that is deferred until
+ * there were no changes for SIDECHAIN_RESTART_DELAY_MS. */
+static void sidechain_changed_cb ()
+{
+    if (sidechain_restart_source)
+        g_source_remove (sidechain_restart_source);
+
+    sidechain_restart_source = g_timeout_add (SIDECHAIN_RESTART_DELAY_MS,
+        restart_sidechain_cb, NULL);
+}
+
+// the timer (on the CLOCK_REALTIME) of the sleep timer and its main loop source
+static int sleep_timer_fd = -1;
+static guint sleep_timer_source = 0;
+// the wall-clock time at which the sleep timer fades out; 0 if it is not armed
+static int64_t sleep_deadline = 0;
+
+/* a GUnixFDSourceFunc which is called when the sleep timer expires */
+static gboolean sleep_timer_cb (gint fd, GIOCondition condition, gpointer data)
+{
+    uint64_t expirations;
+    if (read (fd, & expirations, sizeof expirations) != sizeof expirations ||
+        ! sleep_deadline)
+        return TRUE;
+
+    if (aud_plugin_instance.processing ())
+    {
+        FadeCommand command = {FadeCommand::FadeOut};
+        command.seconds = aud_get_double (AUD_CFG_SECTION,
+            AUD_CFG_KEY_DURATION);
+        command.schedule = FadeCommand::AtTime;
+        command.at = sleep_deadline;
+        aud_plugin_instance.send_fade_command (command);
+    }
+    else
+        AUDINFO ("Sleep timer expired while not playing.\n");
+
+    sleep_deadline = 0;
+    return TRUE;
+}
+
+/* Arms the sleep timer for the given wall-clock time (in microseconds); the
+ * timer fires a little ahead of it. */
+static void arm_sleep_timer (int64_t deadline)
+{
+    if (sleep_timer_fd < 0)
+    {
+        sleep_timer_fd = timerfd_create (CLOCK_REALTIME,
+            TFD_NONBLOCK | TFD_CLOEXEC);
+        if (sleep_timer_fd < 0)
+        {
+            AUDERR ("Could not create the sleep timer: %s\n",
+                strerror (errno));
+            return;
+        }
+
+        sleep_timer_source = g_unix_fd_add (sleep_timer_fd, G_IO_IN,
+            sleep_timer_cb, NULL);
+    }
+
+    int64_t expiry = deadline - SLEEP_TIMER_LEAD_MS * 1000;
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = expiry / G_USEC_PER_SEC;
+    spec.it_value.tv_nsec = expiry % G_USEC_PER_SEC * 1000;
+
+    if (timerfd_settime (sleep_timer_fd, TFD_TIMER_ABSTIME, & spec, NULL) < 0)
+    {
+        AUDERR ("Could not arm the sleep timer: %s\n", strerror (errno));
+        return;
+    }
+
+    // a fade-out scheduled earlier is replaced
+    FadeCommand command = {FadeCommand::Unschedule};
+    command.schedule = FadeCommand::AtTime;
+    aud_plugin_instance.send_fade_command (command);
+    sleep_deadline = deadline;
+
+    time_t seconds = deadline / G_USEC_PER_SEC;
+    AUDINFO ("Fading out at %s", ctime (& seconds));
+}
+
+static void destroy_sleep_timer ()
+{
+    if (sleep_timer_fd >= 0)
+    {
+        g_source_remove (sleep_timer_source);
+        close (sleep_timer_fd);
+        sleep_timer_fd = -1;
+        sleep_timer_source = 0;
+    }
+
+    sleep_deadline = 0;
+}
+
+/* Callback function for the menu item fading out at the configured time. */
+static void sleep_at_time_cb ()
+{
+    String setting = aud_get_str (AUD_CFG_SECTION, AUD_CFG_KEY_SLEEP_TIME);
+    int hours, minutes;
+    if (sscanf (setting, "%d:%d", & hours, & minutes) != 2 ||
+        hours < 0 || hours > 23 || minutes < 0 || minutes > 59)
+    {
+        aud_ui_show_error (str_printf (_("Invalid sleep time: %s"),
+            (const char *) setting));
+        return;
+    }
+
+    // the next time the clock shows the configured time
+    time_t now = time (NULL);
+    struct tm local;
+    localtime_r (& now, & local);
+    local.tm_hour = hours;
+    local.tm_min = minutes;
+    local.tm_sec = 0;
+    local.tm_isdst = -1;
+    time_t deadline = mktime (& local);
+    if (deadline <= now)
+    {
+        local.tm_mday ++;
+        local.tm_isdst = -1;
+        deadline = mktime (& local);
+    }
+
+    arm_sleep_timer ((int64_t) deadline * G_USEC_PER_SEC);
+}
+
+/* Callback function for the menu item fading out after the configured
+ * minutes. */
+static void sleep_after_minutes_cb ()
+{
+    double minutes = aud_get_double (AUD_CFG_SECTION,
+        AUD_CFG_KEY_SLEEP_MINUTES);
+    arm_sleep_timer (g_get_real_time () + (int64_t) (minutes * 60 *
+        G_USEC_PER_SEC));
+}
+
+/* Callback function for the menu item cancelling the sleep timer. */
+static void cancel_sleep_cb ()
+{
+    if (sleep_timer_fd >= 0)
+    {
+        struct itimerspec spec = {};
+        timerfd_settime (sleep_timer_fd, 0, & spec, NULL);
+    }
+
+    sleep_deadline = 0;
+
+    FadeCommand command = {FadeCommand::Unschedule};
+    command.schedule = FadeCommand::AtTime;
+    aud_plugin_instance.send_fade_command (command);
+}
+
+/* Callback function for the menu item fading out at the configured position
+ * of the current song. */
+static void fade_at_position_cb ()
+{
+    String setting = aud_get_str (AUD_CFG_SECTION, AUD_CFG_KEY_FADE_POSITION);
+    int minutes = 0;
+    double seconds;
+    if (sscanf (setting, "%d:%lf", & minutes, & seconds) != 2)
+    {
+        minutes = 0;
+        if (sscanf (setting, "%lf", & seconds) != 1)
+            seconds = -1;
+    }
+
+    if (minutes < 0 || seconds < 0)
+    {
+        aud_ui_show_error (str_printf (_("Invalid song position: %s"),
+            (const char *) setting));
+        return;
+    }
+
+    if (aud_plugin_instance.processing ())
+    {
+        FadeCommand command = {FadeCommand::FadeOut};
+        command.seconds = aud_get_double (AUD_CFG_SECTION,
+            AUD_CFG_KEY_DURATION);
+        command.schedule = FadeCommand::AtPosition;
+        command.at = lround ((minutes * 60 + seconds) * 1000);
+        aud_plugin_instance.send_fade_command (command);
+    }
+}
+
+/* Parses one step of a fade sequence, e.g. "out 3"; returns whether the step
+ * is valid. */
+static bool parse_fade_step (const char * text, FadeStep & step)
+{
+    static const struct {
+        const char * name;
+        FadeStep::Kind kind;
+        bool timed;
+    } kinds[] = {
+        {"out", FadeStep::Out, true},
+        {"in", FadeStep::In, true},
+        {"play", FadeStep::Play, true},
+        {"next", FadeStep::Next, false},
+        {"stop", FadeStep::Stop, false}
+    };
+
+    char name[8];
+    float seconds = 0;
+    int fields = sscanf (text, " %7s %f", name, & seconds);
+    if (fields < 1 || seconds < 0)
+        return false;
+
+    for (auto & kind : kinds)
+    {
+        if (! strcmp (name, kind.name) && (fields == 2) == kind.timed)
+        {
+            step = {kind.kind, seconds};
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Callback function for the menu item queueing the configured fade
+ * sequence; if a sequence is running already, it continues with this one. */
+static void queue_sequence_cb ()
+{
+    String setting = aud_get_str (AUD_CFG_SECTION, AUD_CFG_KEY_FADE_SEQUENCE);
+    Index<String> items = str_list_to_index (setting, ",");
+    Index<FadeStep> steps;
+
+    for (const String & item : items)
+    {
+        FadeStep step;
+        if (! parse_fade_step (item, step))
+        {
+            aud_ui_show_error (str_printf (_("Invalid fade sequence step: %s"),
+                (const char *) item));
+            return;
+        }
+        steps.append (step);
+    }
+
+    if (! aud_plugin_instance.processing () || ! steps.len ())
+        return;
+
+    aud_plugin_instance.send_fade_steps (steps);
+    aud_plugin_instance.send_fade_command ({FadeCommand::Sequence});
+}
+
+/* Callback function for the menu item cancelling a fade sequence; the volume
+ * is restored like after ducking. */
+static void cancel_sequence_cb ()
+{
+    double seconds = aud_get_double (AUD_CFG_SECTION,
+        AUD_CFG_KEY_DUCK_DURATION);
+    aud_plugin_instance.send_fade_command ({FadeCommand::Cancel,
+        (float) seconds, 1, false});
+}
+
+/* Callback function for the menu item stopping after the current song: the
+ * fade-out is scheduled such that it ends with the song. */
+static void fade_at_end_cb ()
+{
+    if (! aud_plugin_instance.processing ())
+        return;
+
+    int length_ms = aud_drct_get_length ();
+    if (length_ms <= 0)
+    {
+        aud_ui_show_error (_("Cannot fade out at the end of a song of unknown "
+            "length."));
+        return;
+    }
+
+    FadeCommand command = {FadeCommand::FadeOut};
+    command.seconds = aud_get_double (AUD_CFG_SECTION, AUD_CFG_KEY_DURATION);
+    command.schedule = FadeCommand::AtPosition;
+    // too close to the end already -- just fade out right away
+    command.at = aud::max (length_ms - (int) (command.seconds * 1000),
+        aud_drct_get_time ());
+    // the song may end before the fade-out does, which must not carry it over
+    command.stop_at_finish = true;
+    aud_plugin_instance.send_fade_command (command);
+}
+
+/* Callback function for invoking the restore menu item. */
+static void restore_cb ()
+{
+    double seconds = aud_get_double (AUD_CFG_SECTION,
+        AUD_CFG_KEY_DUCK_DURATION);
+    aud_plugin_instance.send_fade_command ({FadeCommand::Restore,
+        (float) seconds, 1, false});
+}
+
+// the main loop source waiting for the fade-out on quitting, and when it gives
+// up (in monotonic time)
+static guint quit_source = 0;
+static int64_t quit_deadline = 0;
+
+/* a GSourceFunc which quits Audacious once the fade-out on quitting is done,
+ * or once it took too long (e.g., because the output is stalled) */
+static gboolean quit_fade_cb (gpointer data)
+{
+    if (aud_plugin_instance.quit_fades_done ())
+        log_channel_levels ();
+    else if (g_get_monotonic_time () < quit_deadline)
+        return TRUE;
+    else
+        AUDWARN ("Fade-out on quitting timed out.\n");
+
+    quit_source = 0;
+    aud_quit ();
+    return FALSE;
+}
+
+/* Callback function for the menu item quitting Audacious after a fade-out.
+ * Audacious stops playback before it shuts down its plugins, so the fade has
+ * to run before Audacious is told to quit; the main loop keeps running
+ * meanwhile. */
+static void quit_cb ()
+{
+    if (quit_source)
+        return;  // quitting already
+
+    if (! aud_plugin_instance.processing () || ! aud_drct_get_playing () ||
+        aud_drct_get_paused ())
+    {
+        aud_quit ();
+        return;
+    }
+
+    double seconds = aud::clamp (aud_get_double (AUD_CFG_SECTION,
+        AUD_CFG_KEY_QUIT_DURATION), 0.1, (double) MAX_QUIT_DURATION);
+
+    aud_plugin_instance.send_fade_command ({FadeCommand::Quit,
+        (float) seconds, 0, false});
+
+    quit_deadline = g_get_monotonic_time () +
+        (int64_t) (seconds * G_USEC_PER_SEC) + QUIT_FADE_GRACE_MS * 1000;
+    quit_source = g_timeout_add (QUIT_POLL_MS, quit_fade_cb, NULL);
+}
+
+bool FadeoutPlugin::init ()
+{
+    aud_config_set_defaults (AUD_CFG_SECTION, fadeout_defaults);
+    AUDINFO ("Using the %s variant of the DSP kernels.\n", kernel_variant ());
+
+    // create the menu item and connect it to a callback function
+    aud_plugin_menu_add (AudMenuID::Main, fade_out_cb, _("Fade out"), NULL);
+    aud_plugin_menu_add (AudMenuID::Main, duck_cb, _("Duck volume"), NULL);
+    aud_plugin_menu_add (AudMenuID::Main, restore_cb,
+        _("Restore ducked volume"), NULL);
+    aud_plugin_menu_add (AudMenuID::Main, sleep_at_time_cb,
+        _("Fade out at sleep time"), NULL);
+    aud_plugin_menu_add (AudMenuID::Main, sleep_after_minutes_cb,
+        _("Fade out after sleep minutes"), NULL);
+    aud_plugin_menu_add (AudMenuID::Main, cancel_sleep_cb,
+        _("Cancel sleep timer"), NULL);
+    aud_plugin_menu_add (AudMenuID::Main, fade_at_position_cb,
+        _("Fade out at song position"), NULL);
+    aud_plugin_menu_add (AudMenuID::Main, fade_at_end_cb,
+        _("Fade out and stop after this song"), NULL);
+    aud_plugin_menu_add (AudMenuID::Main, queue_sequence_cb,
+        _("Queue fade sequence"), NULL);
+    aud_plugin_menu_add (AudMenuID::Main, cancel_sequence_cb,
+        _("Cancel fade sequence"), NULL);
+    aud_plugin_menu_add (AudMenuID::Main, quit_cb, _("Fade out and quit"),
+        NULL);
+
+    auto_fade_changed_cb ();
+    across_songs_changed_cb ();
+    smoothing_changed_cb ();
+    width_fade_changed_cb ();
+    echo_changed_cb ();
+    spectral_fade_changed_cb ();
+    ritardando_changed_cb ();
+    lookahead_changed_cb ();
+    load_analysis_cache ();
+    hook_associate ("playback ready", playback_ready_cb, NULL);
+    hook_associate ("playback seek", playback_seek_cb, NULL);
+    hook_associate ("playback stop", playback_stop_cb, NULL);
+
+    beat_align_changed_cb ();
+    analysis_budget_changed_cb ();
+    start_analysis_workers ();
+
+    start_sidechain ();
+
+    return true;
+}
+
+void FadeoutPlugin::cleanup ()
+{
+    if (quit_source)
+    {
+        g_source_remove (quit_source);
+        quit_source = 0;
+    }
+
+    /* switch off any fading for the next time the plugin is used: the streams
+     * start from scratch then, as no audio thread processes them until then */
+    for (FadeStream & stream : streams)
+        stream.use.store (StreamUse::Unused);
+
+    stop_analysis_workers ();
+    if (sidechain_restart_source)
+    {
+        g_source_remove (sidechain_restart_source);
+        sidechain_restart_source = 0;
+    }
+    stop_sidechain ();
+    destroy_sleep_timer ();
+
+    hook_dissociate ("playback ready", playback_ready_cb);
+    hook_dissociate ("playback seek", playback_seek_cb);
+    hook_dissociate ("playback stop", playback_stop_cb);
+    song_analyses.clear ();
+
+    aud_plugin_menu_remove (AudMenuID::Main, fade_out_cb);
+    aud_plugin_menu_remove (AudMenuID::Main, duck_cb);
+    aud_plugin_menu_remove (AudMenuID::Main, restore_cb);
+    aud_plugin_menu_remove (AudMenuID::Main, sleep_at_time_cb);
+    aud_plugin_menu_remove (AudMenuID::Main, sleep_after_minutes_cb);
+    aud_plugin_menu_remove (AudMenuID::Main, cancel_sleep_cb);
+    aud_plugin_menu_remove (AudMenuID::Main, fade_at_position_cb);
+    aud_plugin_menu_remove (AudMenuID::Main, fade_at_end_cb);
+    aud_plugin_menu_remove (AudMenuID::Main, queue_sequence_cb);
+    aud_plugin_menu_remove (AudMenuID::Main, cancel_sequence_cb);
+    aud_plugin_menu_remove (AudMenuID::Main, quit_cb);
+}
+
+void FadeoutPlugin::start (int & channels, int & rate)
+{
+    StreamUse previous;
+    FadeStream & stream = bind_stream (previous);
+    current.store (& stream);
+    stream.start (channels, rate, previous);
+}
+
+/* The stream of the calling audio thread processes the audio; a thread which
+ * has none (as it did not start a song) leaves the audio alone. */
+Index<float> & FadeoutPlugin::process (Index<float> & data)
+{
+    FadeStream * stream = thread_stream ();
+    return stream ? stream->process (data) : data;
+}
+
+bool FadeoutPlugin::flush (bool force)
+{
+    FadeStream * stream = thread_stream ();
+    if (stream)
+        stream->flush ();
+
+    return true;
+}
+
+/* Called from the audio thread as well as from the main thread, which gets
+ * the delay of the current stream. */
+int FadeoutPlugin::adjust_delay (int delay)
+{
+    FadeStream * stream = thread_stream ();
+    if (! stream)
+        stream = current_stream ();
+    if (! stream)
+        return delay;
+
+    // the given delay is one of the output, i.e., at the tempo of the stretch
+    float tempo = stream->output_tempo.load (std::memory_order_relaxed);
+    return lround (delay * tempo) +
+        stream->output_delay_ms.load (std::memory_order_relaxed);
+}
+
+Index<float> & FadeoutPlugin::finish (Index<float> & data,
+    bool end_of_playlist)
+{
+    FadeStream * stream = thread_stream ();
+    return stream ? stream->finish (data, end_of_playlist) : data;
+}
+
+/* Starts a song, given how the stream was used before (i.e., whether it
+ * follows the previous one of the stream); the stream is in use already. */
+void FadeStream::start (int channels, int rate, StreamUse previous)
+{
+    if (previous != StreamUse::Continuing)
+        lookahead_continues = false;
+
+    /* commands and steps which were queued before are not meant for this song
+     * (the main thread only sends them to streams which are playing); a stream
+     * which was not used since the plugin was enabled starts from scratch */
+    FadeCommand command;
+    while (commands.pop (command))
+        ;
+    FadeStep step;
+    while (steps.pop (step))
+        ;
+    if (previous == StreamUse::Unused)
+        reset_fades ();
+
+    // a song following gaplessly goes on with the audio in the lookahead ring
+    bool continues = lookahead_continues &&
+        aud::min (channels, AUD_MAX_CHANNELS) == stream_channels &&
+        rate == stream_rate;
+
+    stream_channels = aud::min (channels, AUD_MAX_CHANNELS);
+    stream_rate = rate;
+    stream_frames = 0;
+    seek_position_ms.store (-1);
+    seek_frames_pending = -1;
+    seek_flushed = false;
+
+    // a position belongs to the song it was scheduled for
+    scheduled_fades.cancel (FadeClock::SongPosition);
+
+    /* a fade-out ends with its song unless it is carried over, but stay
+     * silent while playback is about to be stopped */
+    envelopes.set_rate (rate);
+    width_envelope.set_rate (rate);
+    echo_envelope.set_rate (rate);
+    if (stream_channels != 2)
+        width_envelope.set (1);
+
+    /* the ring is only reallocated when its size changes; a new ring starts
+     * out silent, so the delay stays the same from the first block on */
+    int delay_ms = lookahead_ms.load ();
+    lookahead_frames = (int64_t) rate * delay_ms / 1000;
+    if (lookahead.capacity () != lookahead_frames * stream_channels)
+    {
+        lookahead.allocate (lookahead_frames * stream_channels);
+        continues = false;
+    }
+    if (! continues)
+        lookahead.reset ();
+    lookahead_continues = false;
+
+    // spectral fades delay the audio by an FFT frame
+    spectral.setup (spectral_fade_enabled.load () ? stream_channels : 0, rate,
+        continues);
+    delay_frames = lookahead_frames + spectral.delay ();
+
+    /* going on gaplessly, all that is delayed now is silence: what was drained
+     * at the end of the previous song, and if spectral fades were enabled just
+     * now, the frame they start out with (none if they were disabled) */
+    withheld_frames = continues ? delay_frames : 0;
+    output_delay_ms.store ((int64_t) delay_frames * 1000 / rate);
+    output_tempo.store (1);
+
+    stretch.setup (ritardando_enabled.load () ? stream_channels : 0, rate);
+
+    /* the delay line for echo-outs is allocated for the longest delay, but
+     * only while they are enabled; echoes which cannot go on in a new line
+     * just end (along with the fade-out waiting for them) */
+    int echo_samples = echo_out_enabled.load () ?
+        (int64_t) rate * MAX_ECHO_DELAY / 1000 * stream_channels : 0;
+    if (echo_line.capacity () != echo_samples)
+    {
+        echo_line.allocate (echo_samples);
+        if (echo_active)
+        {
+            echo_active = false;
+            if (fade_state == FadeState::FadingOut &&
+                ! fade_envelope ().ramping ())
+                fade_ramp_finished ();
+        }
+    }
+
+    if (fade_carried)
+        fade_carried = false;  // the envelope keeps its speed at the new rate
+    else if (fade_state == FadeState::Sequencing)
+    {
+        // a sequence goes on with the next song
+        if (sequence_waiting)
+        {
+            sequence_waiting = false;
+            next_sequence_step ();
+        }
+    }
+    else if ((fade_state == FadeState::FadingOut ||
+        fade_state == FadeState::Faded) && ! stop_pending.load ())
+    {
+        fade_envelope ().set (1);
+        fade_state = FadeState::Idle;
+        fade_quitting = false;
+    }
+
+    profiling = auto_fade_enabled.load ();
+    profile_invalid.store (false);
+    profile_windows = 0;
+    profile_window_samples =
+        (int64_t) rate * channels * PROFILE_WINDOW_MS / 1000;
+    profile_samples = 0;
+    profile_square_sum = 0;
+    profile_serial = playing_song_serial.load ();
+    profile_serial_known = false;
+
+    onset_decimation.factor = aud::max (rate / ONSET_RATE, 1);
+    onset_decimation.count = 0;
+    onset_decimation.sum = 0;
+    onset_rate.store (rate / onset_decimation.factor);
+    onset_reset.store (true);
+}
+
+/* Publishes the levels measured by the given meter in channel_levels. */
+static void publish_levels (const LevelMeter & meter, int channels)
+{
+    float peaks[AUD_MAX_CHANNELS], rms[AUD_MAX_CHANNELS];
+    meter.levels (channels, peaks, rms);
+
+    for (int c = 0; c < channels; c++)
+    {
+        channel_levels[c].peak.store (peaks[c], std::memory_order_relaxed);
+        channel_levels[c].rms.store (rms[c], std::memory_order_relaxed);
+    }
+    measured_channels.store (channels, std::memory_order_relaxed);
+}
+
+// the time constant (in ms) of the gain smoother
+static std::atomic<float> smoothing_ms (5);
+
+/* Updates smoothing_ms from the config DB. */
+static void smoothing_changed_cb ()
+{
+    smoothing_ms.store (aud_get_double (AUD_CFG_SECTION,
+        AUD_CFG_KEY_SMOOTHING));
+}
+
+/* Narrows stereo samples according to the width envelope, splitting them
+ * where its ramp ends; other layouts are left alone. */
+void FadeStream::apply_width (float * data, int samples, int channels)
+{
+    if (channels != 2)
+        return;
+
+    // once the fade-out is over (or was cancelled), the width comes back
+    if (fade_state != FadeState::FadingOut && fade_state != FadeState::Faded &&
+        width_envelope.gain () != 1 && ! width_envelope.ramping ())
+        width_envelope.ramp_to (1, WIDTH_RESTORE_TIME);
+
+    for (int frames = samples / 2; frames > 0; )
+    {
+        int segment = width_envelope.segment (frames);
+
+        if (width_envelope.ramping ())
+        {
+            width_table.update (width_envelope.ratio (), 1);
+            apply_side_gain_ramp (data, segment, width_envelope.gain (),
+                width_table);
+        }
+        else if (width_envelope.gain () != 1)
+        {
+            width_table.update (1, 1);
+            apply_side_gain_ramp (data, segment, width_envelope.gain (),
+                width_table);
+        }
+        else
+            return;
+
+        width_envelope.advance (segment);
+        data += segment * 2;
+        frames -= segment;
+    }
+}
+
+/* Applies the combined gain envelopes to the interleaved samples in a single
+ * pass, splitting them where a ramp ends. While the gain is constant, it is
+ * just multiplied in without evaluating the envelopes any further. Jumps of
+ * the gain are smoothed. */
+void FadeStream::apply_envelope (float * data, int samples, int channels)
+{
+    LevelMeter meter;
+    bool measured = false;
+
+    smoother.update (smoothing_ms.load (std::memory_order_relaxed),
+        stream_rate);
+
+    for (int frames = samples / channels; frames > 0; )
+    {
+        int segment = envelopes.segment (frames);
+        double ratio = envelopes.ramping () ? envelopes.ratio () : 1;
+
+        if (smoother.check (envelopes.gain (), channels))
+        {
+            apply_smoothed_gain_ramp (data, segment * channels, channels,
+                envelopes.gain (), ratio, smoother);
+        }
+        else if (envelopes.ramping ())
+        {
+            ramp_table.update (envelopes.ratio (), channels);
+            apply_gain_ramp (data, segment * channels, channels,
+                envelopes.gain (), ramp_table, meter);
+            measured = true;
+        }
+        else if (envelopes.gain () != 1)
+            apply_gain (data, segment * channels, envelopes.gain ());
+
+        smoother.next (envelopes.gain () * pow (ratio, segment), channels);
+
+        if (envelopes.advance (segment) & (1 << FadeSlot))
+            fade_ramp_finished ();
+
+        data += segment * channels;
+        frames -= segment;
+    }
+
+    if (measured)
+        publish_levels (meter, channels);
+}
+
+/* Mixes the echoes of an echo-out into the (already faded) samples, splitting
+ * them at the end of the delay line and where the ramp of the echoes ends. */
+void FadeStream::mix_echo (float * data, int samples, int channels)
+{
+    if (! echo_active)
+        return;
+
+    // once the fade-out is over without them (or was cancelled), they die away
+    if (fade_state != FadeState::FadingOut && fade_state != FadeState::Faded &&
+        ! echo_dying)
+    {
+        echo_envelope.ramp_to (FADE_FLOOR, ECHO_CANCEL_TIME);
+        echo_dying = true;
+    }
+
+    for (int frames = samples / channels; frames > 0; )
+    {
+        // up to the end of the delay line at most
+        int line_samples = echo_envelope.segment (frames) * channels;
+        float * line = echo_line.next (line_samples);
+        int segment = line_samples / channels;
+
+        echo_table.update (echo_envelope.ramping () ?
+            echo_envelope.ratio () : 1, channels);
+        apply_echo (data, line, segment * channels, channels,
+            echo_envelope.gain (), ECHO_FEEDBACK, echo_table);
+        echo_line.advance (segment * channels);
+
+        if (echo_envelope.advance (segment))
+        {
+            // the echoes have rung out -- now the fade-out is over
+            echo_active = false;
+            if (fade_state == FadeState::FadingOut &&
+                ! fade_envelope ().ramping ())
+                fade_ramp_finished ();
+            return;
+        }
+
+        data += segment * channels;
+        frames -= segment;
+    }
+}
+
+Index<float> & FadeStream::process (Index<float> & data, bool draining)
+{
+    if (stream_channels <= 0)
+        return data;
+
+    int64_t seek_ms = seek_position_ms.exchange (-1);
+    if (seek_ms >= 0)
+    {
+        // the frames since the flush were counted from zero
+        int64_t seek_frames = seek_ms * stream_rate / 1000;
+        if (seek_flushed)
+            stream_frames += seek_frames;
+        else
+            seek_frames_pending = seek_frames;
+        seek_flushed = false;
+    }
+
+    int frames = data.len () / stream_channels;
+    int64_t block_position = stream_frames;
+    stream_frames += frames;
+    active_time.store (g_get_monotonic_time (), std::memory_order_relaxed);
+
+    // a stream which was retired while its thread stalled is playing after all
+    StreamUse retired = StreamUse::Retired;
+    if (use.load (std::memory_order_relaxed) == retired)
+        use.compare_exchange_strong (retired, StreamUse::Playing);
+
+    // the current song is analyzed (and faded out automatically) by its stream
+    if (aud_plugin_instance.current_stream () == this)
+    {
+        // positions are where the audio comes out, i.e., after the delay
+        int fade_ms = auto_fade_ms.load (std::memory_order_relaxed);
+        if (fade_ms >= 0 && stream_frames - delay_frames >=
+            (int64_t) fade_ms * stream_rate / 1000 &&
+            auto_fade_ms.compare_exchange_strong (fade_ms, -1))
+        {
+            g_idle_add (auto_fade_cb, NULL);
+        }
+
+        if (profiling)
+            measure_profile (data.begin (), data.len ());
+
+        if (beat_align_enabled.load (std::memory_order_relaxed))
+        {
+            feed_beat_tracker (data.begin (), data.len (), stream_channels,
+                onset_decimation);
+        }
+    }
+    else
+        profiling = false;  // another song started, so this one is left out
+
+    /* while slowing down, the output has more frames than the input; they
+     * start where the song has got to in the output so far (and the rest of
+     * the stretched audio is let out when draining) */
+    double tempo = 1;
+    if (stretch.enabled () && ! draining)
+        tempo = 1 - (1 - RITARDANDO_TEMPO) * fade_progress ();
+
+    int64_t position = block_position - delay_frames - stretch.delay ();
+    if (stretch.enabled ())
+    {
+        int frames;
+        const float * stretched = stretch.process (data.begin (),
+            data.len () / stream_channels, tempo, frames);
+        if (stretched != data.begin ())
+        {
+            data.resize (frames * stream_channels);
+            memcpy (data.begin (), stretched,
+                sizeof (float) * frames * stream_channels);
+        }
+    }
+
+    /* the delay after the stretch passes at its tempo: only a part of a frame
+     * of the input comes out per frame of the output */
+    if (stretch.enabled ())
+    {
+        output_delay_ms.store ((int64_t) (delay_frames * tempo +
+            stretch.delay ()) * 1000 / stream_rate, std::memory_order_relaxed);
+        output_tempo.store (tempo, std::memory_order_relaxed);
+    }
+
+    int withheld = render (data.begin (), data.len () / stream_channels,
+        position);
+    if (withheld)
+        data.remove (0, withheld * stream_channels);
+
+    return data;
+}
+
+/* Returns how far the fade envelope is between unity gain and the fade floor,
+ * as a fraction of the floor in dB. */
+float FadeStream::fade_progress ()
+{
+    double floor = song_fade_floor.load (std::memory_order_relaxed);
+    return aud::clamp (log (fade_envelope ().gain ()) / log (floor), 0.0, 1.0);
+}
+
+/* Produces the output for the given frames, which start at the given song
+ * position (in frames; negative while the delay of the output fills up);
+ * returns how many frames at the start are to be left out of it. */
+int FadeStream::render (float * data, int frames, int64_t position)
+{
+    int samples = frames * stream_channels;
+    if (lookahead_frames)
+        lookahead.delay (data, samples);
+
+    run_fade_commands ();
+
+    /* the sidechain gain is updated once per capture period, so ramp to a new
+     * one within that time in order to avoid zipper noise (but not over the
+     * whole block, which would add to the latency); a reset of the envelopes
+     * leaves the slot at unity gain, which is ramped back from, too */
+    float gain = sidechain_gain.load (std::memory_order_relaxed);
+    GainEnvelope & sidechain = envelopes.slot (SidechainSlot);
+    if (gain != sidechain_target ||
+        (! sidechain.ramping () && sidechain.gain () != gain))
+    {
+        sidechain_target = gain;
+        sidechain.ramp_to (gain, (double) SIDECHAIN_PERIOD / SIDECHAIN_RATE);
+    }
+
+    if (spectral.enabled ())
+    {
+        spectral.process (data, frames, fade_progress (),
+            song_fade_floor.load (std::memory_order_relaxed));
+    }
+
+    // the silence after a drained song is not faded (the envelopes are ahead)
+    int withheld = aud::min (frames, withheld_frames);
+    withheld_frames -= withheld;
+    data += withheld * stream_channels;
+    frames -= withheld;
+    samples = frames * stream_channels;
+    position += withheld;
+
+    /* start a scheduled fade-out exactly at its frame; a start which passed
+     * long ago (e.g., while paused or before a seek) is void */
+    int64_t now = g_get_real_time ();
+    if (scheduled_fades.drop_overdue (now, position, stream_rate))
+        AUDINFO ("Dropping a scheduled fade-out which is overdue.\n");
+
+    FadeCommand scheduled;
+    int offset = scheduled_fades.next (now, position, frames, stream_rate,
+        scheduled);
+    if (offset >= 0)
+    {
+        float * rest = data + offset * stream_channels;
+        apply_width (data, offset * stream_channels, stream_channels);
+        apply_envelope (data, offset * stream_channels, stream_channels);
+        mix_echo (data, offset * stream_channels, stream_channels);
+        begin_fade_out (scheduled);
+        apply_width (rest, (frames - offset) * stream_channels,
+            stream_channels);
+        apply_envelope (rest, (frames - offset) * stream_channels,
+            stream_channels);
+        mix_echo (rest, (frames - offset) * stream_channels, stream_channels);
+    }
+    else
+    {
+        apply_width (data, samples, stream_channels);
+        apply_envelope (data, samples, stream_channels);
+        mix_echo (data, samples, stream_channels);
+    }
+
+    return withheld;
+}
+
+void FadeStream::flush ()
+{
+    // count from zero until the position of the seek is known
+    int64_t seek_ms = seek_position_ms.exchange (-1);
+    if (seek_ms >= 0)
+        seek_frames_pending = seek_ms * stream_rate / 1000;
+
+    if (seek_frames_pending >= 0)
+    {
+        stream_frames = seek_frames_pending;
+        seek_frames_pending = -1;
+        seek_flushed = false;
+    }
+    else
+    {
+        stream_frames = 0;
+        seek_flushed = true;
+    }
+
+    /* nothing of the audio before the flush may carry over: a pending glide
+     * of the smoother would end on unrelated audio, and the beat grid does
+     * not match anymore (the envelopes just go on, as they are about time,
+     * not audio); nothing is allocated here, but clearing the buffers of the
+     * spectral fade takes time linear in their size */
+    smoother.settle ();
+    lookahead.reset ();
+    withheld_frames = 0;
+    if (spectral.enabled ())
+        spectral.reset ();
+    if (stretch.enabled ())
+        stretch.reset ();
+    onset_decimation.count = 0;
+    onset_decimation.sum = 0;
+    if (aud_plugin_instance.current_stream () == this)
+        onset_reset.store (true);
+
+    /* the echoes were of the audio before the flush, so they end (along with
+     * the fade-out waiting for them) and the delay line is silent again */
+    echo_line.reset ();
+    if (echo_active)
+    {
+        echo_active = false;
+        if (fade_state == FadeState::FadingOut &&
+            ! fade_envelope ().ramping ())
+            fade_ramp_finished ();
+    }
+}
+
+Index<float> & FadeStream::finish (Index<float> & data, bool end_of_playlist)
+{
+    Index<float> & output = process (data, true);
+    submit_profile (stream_frames * 1000 / stream_rate);
+
+    /* the end of the song which is still delayed (in the lookahead ring or
+     * the spectral fade) is let out now, as the next song may come in another
+     * format; if it does not, it goes on with the silence which was delayed in
+     * its place left out, so that it follows without a gap */
+    if (delay_frames && stream_channels > 0)
+    {
+        int samples = output.len ();
+        output.insert (-1, delay_frames * stream_channels);
+        int withheld = render (output.begin () + samples, delay_frames,
+            stream_frames - delay_frames);
+        if (withheld)
+            output.remove (samples, withheld * stream_channels);
+    }
+
+    if (! end_of_playlist)
+        lookahead_continues = true;
+
+    // make sure to stop with the current song if fading out is active; an
+    // automatic fade just ends as the next song is coming anyway, and a fade
+    // may also be carried over into the next song (gaplessly)
+    if (fade_state == FadeState::Sequencing && sequence_waiting)
+    {
+        // the song ended before the sequence skipped it
+        stop_pending.store (false);
+    }
+    else if (fade_state == FadeState::FadingOut ||
+        fade_state == FadeState::Faded)
+    {
+        if (fade_to_next_song)
+        {
+            stop_pending.store (false);
+            fade_envelope ().set (1);
+            fade_state = FadeState::Idle;
+        }
+        else if (fade_state == FadeState::FadingOut && ! end_of_playlist &&
+            fade_across_songs.load () && ! fade_stops_at_finish)
+        {
+            fade_carried = true;
+        }
+        else if (fade_state == FadeState::FadingOut)
+        {
+            fade_envelope ().set (song_fade_floor.load ());
+            fade_state = FadeState::Faded;
+            stop_playback (false);
+        }
     }
 
-    is_plugin_processing = false;
+    use.store (end_of_playlist ? StreamUse::Ended : StreamUse::Continuing);
 
-    return process (data);
+    return output;
 }
 
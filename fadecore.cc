@@ -0,0 +1,682 @@
+/*
+ * Audacious FadeOut Plugin
+ *
+ * fadecore: the DSP kernels.
+ *
+ * Copyright (C) 2008–2018  Christian Spurk
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fadecore.h"
+
+#include <string.h>
+
+/* The DSP kernels are compiled for several instruction sets, and the best one
+ * for the CPU is picked when the plugin is loaded -- unless the whole build is
+ * tuned for the CPU of the build host (FADEOUT_NATIVE) anyway. */
+#if defined (__x86_64__) && defined (__GNUC__) && ! defined (FADEOUT_NATIVE)
+#define DSP_KERNEL_CLONES 1
+#define DSP_KERNEL \
+    __attribute__ ((target_clones ("avx512f", "avx2", "default")))
+#else
+#define DSP_KERNEL
+#endif
+
+// number of partial sums of correlate(), enough for the widest vectors
+#define CORRELATION_LANES 16
+// number of samples apply_gain() multiplies side by side
+#define GAIN_LANES 16
+// frequencies (in Hz) up to which a spectral fade takes as long as a plain
+// one, and from which on it takes SPECTRAL_TREBLE_SHARE of that time
+#define SPECTRAL_BASS 150
+#define SPECTRAL_TREBLE 8000
+#define SPECTRAL_TREBLE_SHARE 0.3
+// length (in ms) of the frames the time stretching puts together (at 50 %
+// overlap), and how far (in ms) it may move them to make them fit
+#define WSOLA_FRAME_MS 40
+#define WSOLA_TOLERANCE_MS 10
+
+/* Multiplies the samples by a constant gain, GAIN_LANES at a time: a loop of
+ * a fixed length is vectorized even at -O2, where GCC leaves loops alone
+ * which would need a scalar epilogue. */
+DSP_KERNEL
+void apply_gain (float * __restrict data, int samples, float gain)
+{
+    int i = 0;
+    for (; i + GAIN_LANES <= samples; i += GAIN_LANES)
+    {
+        float * __restrict chunk = data + i;
+        for (int l = 0; l < GAIN_LANES; l++)
+            chunk[l] *= gain;
+    }
+    for (; i < samples; i++)
+        data[i] *= gain;
+}
+
+/* Multiplies the interleaved samples by a gain which starts at the given value
+ * and is multiplied by the ratio of the given table after each frame, and
+ * measures the peak and RMS level of each channel of the result in the same
+ * pass. The samples are processed in chunks of FADECORE_METER_LANE_FRAMES
+ * frames where each sample has its own lane of gain and level, so the inner
+ * loop runs over contiguous memory without any per-channel branching and can
+ * be vectorized by the compiler. The peaks have to be taken with a comparison
+ * (not fmaxf(), whose handling of NaNs keeps GCC from vectorizing). */
+DSP_KERNEL
+void apply_gain_ramp (float * data, int samples, int channels,
+    double gain, const RampTable & table, LevelMeter & meter)
+{
+    const int lanes = channels * FADECORE_METER_LANE_FRAMES;
+    float lane_gain[FADECORE_MAX_CHANNELS * FADECORE_METER_LANE_FRAMES];
+    for (int l = 0; l < lanes; l++)
+        lane_gain[l] = gain * table.lane_ratio[l];
+    const float chunk_ratio = table.chunk_ratio;
+
+    // the levels are kept in lanes of their own, which nothing else aliases
+    float peak[FADECORE_MAX_CHANNELS * FADECORE_METER_LANE_FRAMES];
+    float square_sum[FADECORE_MAX_CHANNELS * FADECORE_METER_LANE_FRAMES];
+    for (int l = 0; l < lanes; l++)
+    {
+        peak[l] = meter.peak[l];
+        square_sum[l] = meter.square_sum[l];
+    }
+
+    int i = 0;
+    for (; i + lanes <= samples; i += lanes)
+    {
+        float * __restrict chunk = data + i;
+        for (int l = 0; l < lanes; l++)
+        {
+            float f = chunk[l] * lane_gain[l];
+            float a = fabsf (f);
+            chunk[l] = f;
+            peak[l] = a > peak[l] ? a : peak[l];
+            square_sum[l] += f * f;
+            lane_gain[l] *= chunk_ratio;
+        }
+    }
+    // the remaining samples; always starts at the first channel
+    for (int l = 0; i < samples; i++, l++)
+    {
+        float f = data[i] * lane_gain[l];
+        float a = fabsf (f);
+        data[i] = f;
+        peak[l] = a > peak[l] ? a : peak[l];
+        square_sum[l] += f * f;
+    }
+
+    for (int l = 0; l < lanes; l++)
+    {
+        meter.peak[l] = peak[l];
+        meter.square_sum[l] = square_sum[l];
+    }
+    meter.frames += samples / channels;
+}
+
+/* Multiplies the interleaved samples by a gain ramp (as in apply_gain_ramp())
+ * which is followed by the smoother of each channel. The recursion of the
+ * filter runs from frame to frame, so the channels are what is processed side
+ * by side here. */
+DSP_KERNEL
+void apply_smoothed_gain_ramp (float * data, int samples, int channels,
+    double gain, double ratio, GainSmoother & smoother)
+{
+    float * __restrict state = smoother.gain;
+    const float coefficient = smoother.coefficient;
+    double target = gain;
+
+    for (int i = 0; i < samples; i += channels)
+    {
+        float * __restrict frame = data + i;
+        for (int c = 0; c < channels; c++)
+        {
+            state[c] += coefficient * ((float) target - state[c]);
+            frame[c] *= state[c];
+        }
+        target *= ratio;
+    }
+}
+
+/* Multiplies the side channel of interleaved stereo samples by a gain which
+ * starts at the given value and is multiplied by the ratio of the given table
+ * (built for one channel) after each frame. The mid/side matrix is computed
+ * in place, frame by frame in lanes as in apply_gain_ramp(), so that the
+ * compiler can vectorize it. */
+DSP_KERNEL
+void apply_side_gain_ramp (float * data, int frames, double gain,
+    const RampTable & table)
+{
+    float lane_gain[FADECORE_METER_LANE_FRAMES];
+    for (int l = 0; l < FADECORE_METER_LANE_FRAMES; l++)
+        lane_gain[l] = 0.5 * gain * table.lane_ratio[l];
+    const float chunk_ratio = table.chunk_ratio;
+
+    int f = 0;
+    for (; f + FADECORE_METER_LANE_FRAMES <= frames;
+        f += FADECORE_METER_LANE_FRAMES)
+    {
+        float * __restrict chunk = data + 2 * f;
+        for (int l = 0; l < FADECORE_METER_LANE_FRAMES; l++)
+        {
+            float left = chunk[2 * l], right = chunk[2 * l + 1];
+            float mid = 0.5f * (left + right);
+            float side = lane_gain[l] * (left - right);
+            chunk[2 * l] = mid + side;
+            chunk[2 * l + 1] = mid - side;
+            lane_gain[l] *= chunk_ratio;
+        }
+    }
+    for (int l = 0; f < frames; f++, l++)
+    {
+        float left = data[2 * f], right = data[2 * f + 1];
+        float mid = 0.5f * (left + right);
+        float side = lane_gain[l] * (left - right);
+        data[2 * f] = mid + side;
+        data[2 * f + 1] = mid - side;
+    }
+}
+
+/* Mixes the echo of a feedback delay line into the interleaved samples: each
+ * sample gets the one from the line (i.e., from one delay earlier) added with
+ * a gain as in apply_gain_ramp(), and is itself fed back into the line along
+ * with that echo, scaled by the feedback. The line holds the next samples of
+ * the delay, so it has to be at least as long as the data. */
+DSP_KERNEL
+void apply_echo (float * data, float * line, int samples, int channels,
+    double gain, float feedback, const RampTable & table)
+{
+    const int lanes = channels * FADECORE_METER_LANE_FRAMES;
+    float lane_gain[FADECORE_MAX_CHANNELS * FADECORE_METER_LANE_FRAMES];
+    for (int l = 0; l < lanes; l++)
+        lane_gain[l] = gain * table.lane_ratio[l];
+    const float chunk_ratio = table.chunk_ratio;
+
+    int i = 0;
+    for (; i + lanes <= samples; i += lanes)
+    {
+        float * __restrict chunk = data + i;
+        float * __restrict delayed = line + i;
+        for (int l = 0; l < lanes; l++)
+        {
+            float echo = lane_gain[l] * delayed[l];
+            delayed[l] = chunk[l] + feedback * echo;
+            chunk[l] += echo;
+            lane_gain[l] *= chunk_ratio;
+        }
+    }
+    for (int l = 0; i < samples; i++, l++)
+    {
+        float echo = lane_gain[l] * line[i];
+        line[i] = data[i] + feedback * echo;
+        data[i] += echo;
+    }
+}
+
+/* Returns the cross-correlation of two signals, i.e., the sum of the products
+ * of their samples. The products are summed up in CORRELATION_LANES lanes side
+ * by side, so that the compiler can vectorize the loop. */
+DSP_KERNEL
+float correlate (const float * a, const float * b, int samples)
+{
+    float lane_sum[CORRELATION_LANES] = {};
+
+    int i = 0;
+    for (; i + CORRELATION_LANES <= samples; i += CORRELATION_LANES)
+    {
+        const float * __restrict chunk_a = a + i;
+        const float * __restrict chunk_b = b + i;
+        for (int l = 0; l < CORRELATION_LANES; l++)
+            lane_sum[l] += chunk_a[l] * chunk_b[l];
+    }
+
+    float sum = 0;
+    for (; i < samples; i++)
+        sum += a[i] * b[i];
+    for (int l = 0; l < CORRELATION_LANES; l++)
+        sum += lane_sum[l];
+
+    return sum;
+}
+
+/* Returns which variant of the DSP kernels runs on this CPU; the same choice
+ * is made by the resolvers of the kernel clones. */
+const char * kernel_variant ()
+{
+#ifdef FADEOUT_NATIVE
+    return "native";
+#elif defined (DSP_KERNEL_CLONES)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx512f"))
+        return "avx512f";
+    if (__builtin_cpu_supports ("avx2"))
+        return "avx2";
+    return "default";
+#else
+    return "generic";
+#endif
+}
+
+/* Exchanges the given interleaved samples with the oldest ones in the ring, in
+ * (at most) two chunks up to and from its end. */
+void DelayLine::delay (float * data, int samples)
+{
+    while (samples > 0)
+    {
+        int chunk = samples;
+        float * ring = next (chunk);
+        std::swap_ranges (ring, ring + chunk, data);
+        advance (chunk);
+
+        data += chunk;
+        samples -= chunk;
+    }
+}
+
+/* A real FFT of a fixed size, computed by a complex FFT of half the size with
+ * the even samples as real and the odd ones as imaginary parts; the spectrum
+ * has Size / 2 + 1 bins. The inverse transform includes the scaling by
+ * 1 / Size, so that it restores the original samples. */
+template<int Size>
+class RealFft
+{
+public:
+    RealFft ()
+    {
+        for (int k = 0; k < Size / 2; k++)
+        {
+            m_cos[k] = cos (2 * M_PI * k / Size);
+            m_sin[k] = -sin (2 * M_PI * k / Size);
+        }
+    }
+
+    void forward (const float * data, float * re, float * im) const
+    {
+        for (int n = 0; n < Half; n++)
+        {
+            re[n] = data[2 * n];
+            im[n] = data[2 * n + 1];
+        }
+
+        m_fft.transform (re, im);
+
+        // separate the spectra of the even and the odd samples, which are
+        // symmetric, and combine them -- pairwise from both ends
+        float z0 = re[0];
+        re[0] = z0 + im[0];
+        re[Half] = z0 - im[0];
+        im[0] = im[Half] = 0;
+
+        for (int k = 1; k <= Half / 2; k++)
+        {
+            int j = Half - k;
+            float even_re = 0.5f * (re[k] + re[j]);
+            float even_im = 0.5f * (im[k] - im[j]);
+            float odd_re = 0.5f * (im[k] + im[j]);
+            float odd_im = -0.5f * (re[k] - re[j]);
+            float tr = m_cos[k] * odd_re - m_sin[k] * odd_im;
+            float ti = m_cos[k] * odd_im + m_sin[k] * odd_re;
+            re[k] = even_re + tr;
+            im[k] = even_im + ti;
+            re[j] = even_re - tr;
+            im[j] = ti - even_im;
+        }
+    }
+
+    void inverse (float * re, float * im, float * data) const
+    {
+        float x0 = re[0], xh = re[Half];
+        re[0] = 0.5f * (x0 + xh);
+        im[0] = 0.5f * (x0 - xh);
+
+        // the spectra of the even and the odd samples again, as one spectrum
+        // of half the size (conjugated for the inverse transform)
+        for (int k = 1; k <= Half / 2; k++)
+        {
+            int j = Half - k;
+            float even_re = 0.5f * (re[k] + re[j]);
+            float even_im = 0.5f * (im[k] - im[j]);
+            float tr = 0.5f * (re[k] - re[j]);
+            float ti = 0.5f * (im[k] + im[j]);
+            float odd_re = m_cos[k] * tr + m_sin[k] * ti;
+            float odd_im = m_cos[k] * ti - m_sin[k] * tr;
+            re[k] = even_re - odd_im;
+            im[k] = -(even_im + odd_re);
+            re[j] = even_re + odd_im;
+            im[j] = -(odd_re - even_im);
+        }
+        im[0] = -im[0];
+
+        m_fft.transform (re, im);
+
+        const float scale = 1.0f / Half;
+        for (int n = 0; n < Half; n++)
+        {
+            data[2 * n] = re[n] * scale;
+            data[2 * n + 1] = -im[n] * scale;
+        }
+    }
+
+private:
+    static constexpr int Half = Size / 2;
+
+    Fft<Half> m_fft;
+    float m_cos[Half], m_sin[Half];
+};
+
+static const RealFft<FADECORE_SPECTRAL_FFT_SIZE> spectral_fft;
+
+void SpectralFade::setup (int channels, int rate, bool continues)
+{
+    const int size = FADECORE_SPECTRAL_FFT_SIZE;
+    const int samples = channels * (size + FADECORE_SPECTRAL_HOP);
+    if ((int) m_input.size () != samples)
+    {
+        m_input.resize (samples);
+        m_output.resize (channels * size);
+        continues = false;
+    }
+
+    m_channels = channels;
+    if (! continues)
+        reset ();
+
+    for (int n = 0; n < size; n++)
+        m_window[n] = 0.5 - 0.5 * cos (2 * M_PI * n / size);
+
+    /* the windows of the overlapping frames add up to 1.5; the part of that
+     * which the frames before the current one contribute at each position is
+     * needed for switching from delaying to transforming */
+    for (int n = 0; n < size; n++)
+    {
+        m_partial[n] = 0;
+        for (int m = n + FADECORE_SPECTRAL_HOP; m < size;
+            m += FADECORE_SPECTRAL_HOP)
+            m_partial[n] += m_window[m] * m_window[m] / 1.5f;
+    }
+
+    // the share of the fade duration after which each bin reaches the floor
+    for (int k = 0; k <= size / 2; k++)
+    {
+        double freq = (double) k * rate / size;
+        double share = 1;
+        if (freq >= SPECTRAL_TREBLE)
+            share = SPECTRAL_TREBLE_SHARE;
+        else if (freq > SPECTRAL_BASS)
+            share = 1 + (SPECTRAL_TREBLE_SHARE - 1) *
+                log (freq / SPECTRAL_BASS) /
+                log ((double) SPECTRAL_TREBLE / SPECTRAL_BASS);
+
+        m_inverse_share[k] = 1 / share;
+    }
+}
+
+/* Takes time linear in the size of the buffers, as they are cleared. */
+void SpectralFade::reset ()
+{
+    std::fill (m_input.begin (), m_input.end (), 0.0f);
+    std::fill (m_output.begin (), m_output.end (), 0.0f);
+    m_fill = 0;
+    m_transforming = false;
+    m_unweighted_hops = 0;
+}
+
+void SpectralFade::process (float * data, int frames, float progress,
+    double floor)
+{
+    const int size = FADECORE_SPECTRAL_FFT_SIZE;
+    while (frames > 0)
+    {
+        int chunk = std::min (frames, FADECORE_SPECTRAL_HOP - m_fill);
+        for (int c = 0; c < m_channels; c++)
+        {
+            float * in = m_input.data () + c * (size + FADECORE_SPECTRAL_HOP);
+            const float * out = m_transforming ?
+                m_output.data () + c * size : in;
+            float * samples = data + c;
+
+            for (int i = 0; i < chunk; i++)
+            {
+                in[size + m_fill + i] = samples[i * m_channels];
+                samples[i * m_channels] = out[m_fill + i];
+            }
+        }
+
+        m_fill += chunk;
+        data += chunk * m_channels;
+        frames -= chunk;
+
+        if (m_fill == FADECORE_SPECTRAL_HOP)
+        {
+            hop (progress, floor);
+            m_fill = 0;
+        }
+    }
+}
+
+void SpectralFade::hop (float progress, double floor)
+{
+    const int size = FADECORE_SPECTRAL_FFT_SIZE;
+    const int hop = FADECORE_SPECTRAL_HOP;
+    bool weighted = (progress > 0 && progress < 1);
+
+    if (weighted)
+    {
+        const float log_floor = log (floor);
+        for (int k = 0; k <= size / 2; k++)
+            m_gain[k] = expf (log_floor * (fminf (progress *
+                m_inverse_share[k], 1) - progress));
+
+        m_unweighted_hops = 0;
+    }
+    else if (m_transforming && ++ m_unweighted_hops >= size / hop)
+    {
+        // the output is just the delayed input again
+        m_transforming = false;
+    }
+
+    for (int c = 0; c < m_channels; c++)
+    {
+        float * in = m_input.data () + c * (size + hop);
+        float * out = m_output.data () + c * size;
+
+        memmove (in, in + hop, sizeof (float) * size);
+
+        if (m_transforming)
+        {
+            memmove (out, out + hop, sizeof (float) * (size - hop));
+            memset (out + size - hop, 0, sizeof (float) * hop);
+        }
+        else if (weighted)
+        {
+            // the frames before this one as if they had been transformed
+            for (int n = 0; n < size; n++)
+                out[n] = in[n] * m_partial[n];
+        }
+        else
+            continue;
+
+        if (weighted)
+        {
+            for (int n = 0; n < size; n++)
+                m_frame[n] = in[n] * m_window[n];
+
+            spectral_fft.forward (m_frame, m_re, m_im);
+            for (int k = 0; k <= size / 2; k++)
+            {
+                m_re[k] *= m_gain[k];
+                m_im[k] *= m_gain[k];
+            }
+            spectral_fft.inverse (m_re, m_im, m_frame);
+
+            for (int n = 0; n < size; n++)
+                out[n] += m_frame[n] * m_window[n] / 1.5f;
+        }
+        else
+        {
+            // an unweighted frame comes out as it went in
+            for (int n = 0; n < size; n++)
+                out[n] += in[n] * m_window[n] * m_window[n] / 1.5f;
+        }
+    }
+
+    if (weighted)
+        m_transforming = true;
+}
+
+void TimeStretch::setup (int channels, int rate)
+{
+    m_channels = channels;
+    m_hop = rate * WSOLA_FRAME_MS / 2000;
+    m_tolerance = rate * WSOLA_TOLERANCE_MS / 1000;
+
+    m_window.resize (channels ? 2 * m_hop : 0);
+    for (int n = 0; n < (int) m_window.size (); n++)
+        m_window[n] = 0.5 - 0.5 * cos (M_PI * n / m_hop);
+
+    // enough for a stretched block of the usual size
+    int frames = channels ? 4 * m_hop + 2 * m_tolerance : 0;
+    m_input.resize (frames * channels);
+    m_output.resize (2 * frames * channels);
+
+    reset ();
+}
+
+const float * TimeStretch::process (const float * data, int frames,
+    double tempo, int & output_frames)
+{
+    if (! m_stretching)
+    {
+        output_frames = frames;
+        if (tempo >= 1)
+            return data;
+
+        /* start as if the last frame had ended with the audio so far, so that
+         * its second half is the first one of the block */
+        m_stretching = true;
+        m_frames = 0;
+        m_previous = m_position = -m_hop;
+    }
+
+    const int channels = m_channels;
+    if ((int) m_input.size () < (m_frames + frames) * channels)
+        m_input.resize ((m_frames + frames) * channels);
+    memcpy (m_input.data () + m_frames * channels, data,
+        sizeof (float) * frames * channels);
+    m_frames += frames;
+
+    int output = 0;
+    if (tempo >= 1)
+    {
+        // the second half of the last frame and the next one add up to the
+        // input itself, so just let out the rest of it
+        int rest = m_frames - (m_previous + m_hop);
+        reserve_output (rest);
+        memcpy (m_output.data (), m_input.data () + (m_previous + m_hop) *
+            channels, sizeof (float) * rest * channels);
+        output = rest;
+        m_stretching = false;
+    }
+    else
+    {
+        for (;;)
+        {
+            double position = m_position + m_hop * tempo;
+            int nominal = lround (position);
+            if (nominal + m_tolerance + 2 * m_hop > m_frames)
+                break;
+
+            reserve_output (output + m_hop);
+            overlap_add (m_output.data () + output * channels,
+                best_frame (nominal));
+            output += m_hop;
+            m_position = position;
+        }
+
+        // drop the input which no frame can start in anymore
+        int drop = std::min (std::max ((int) floor (m_position) - m_tolerance,
+            0), m_previous + m_hop);
+        memmove (m_input.data (), m_input.data () + drop * channels,
+            sizeof (float) * (m_frames - drop) * channels);
+        m_frames -= drop;
+        m_previous -= drop;
+        m_position -= drop;
+    }
+
+    output_frames = output;
+    return m_output.data ();
+}
+
+// grows the output (which keeps its memory when it is shrunk again)
+void TimeStretch::reserve_output (int frames)
+{
+    if ((int) m_output.size () < frames * m_channels)
+        m_output.resize (frames * m_channels);
+}
+
+/* Returns where the frame within the tolerance around the given position
+ * starts whose first half is most similar to the second half of the last
+ * frame (by normalized cross-correlation). */
+int TimeStretch::best_frame (int nominal)
+{
+    const int channels = m_channels;
+    const int samples = m_hop * channels;
+    const float * target = m_input.data () + (m_previous + m_hop) * channels;
+
+    int from = std::max (nominal - m_tolerance, 0);
+    int to = nominal + m_tolerance;
+
+    // the energy of each candidate is updated as it slides along
+    const float * candidate = m_input.data () + from * channels;
+    float energy = correlate (candidate, candidate, samples);
+
+    int best = from;
+    float best_score = -INFINITY;
+    for (int start = from; start <= to; start++)
+    {
+        float score = correlate (target, candidate, samples) /
+            sqrtf (energy + 1e-9f);
+        if (score > best_score)
+        {
+            best = start;
+            best_score = score;
+        }
+
+        for (int c = 0; c < channels; c++)
+            energy += candidate[samples + c] * candidate[samples + c] -
+                candidate[c] * candidate[c];
+        candidate += channels;
+    }
+
+    return best;
+}
+
+// mixes the second half of the last frame with the first one of the next
+void TimeStretch::overlap_add (float * output, int next)
+{
+    const int channels = m_channels;
+    const float * fading = m_input.data () + (m_previous + m_hop) * channels;
+    const float * rising = m_input.data () + next * channels;
+
+    for (int n = 0; n < m_hop; n++)
+    {
+        float fade_out = m_window[m_hop + n], fade_in = m_window[n];
+        for (int c = 0; c < channels; c++)
+        {
+            int i = n * channels + c;
+            output[i] = fade_out * fading[i] + fade_in * rising[i];
+        }
+    }
+
+    m_previous = next;
+}
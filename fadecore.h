@@ -0,0 +1,779 @@
+/*
+ * Audacious FadeOut Plugin
+ *
+ * fadecore: the envelopes, gain curves, fade scheduler, audio buffers and DSP
+ * kernels of the plugin, which do not depend on Audacious, so that other
+ * programs (e.g., benchmarks or an offline renderer) can use them as well.
+ *
+ * Copyright (C) 2008–2018  Christian Spurk
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FADECORE_H
+#define FADECORE_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// maximum number of channels of a stream (as AUD_MAX_CHANNELS in Audacious)
+#define FADECORE_MAX_CHANNELS 10
+// number of interleaved frames the level meter accumulates side by side
+#define FADECORE_METER_LANE_FRAMES 8
+// relative difference below which the gain smoother counts as settled
+#define FADECORE_SMOOTHER_EPSILON 1e-4
+// size of the FFT frames of spectral fades (must be a power of two), and the
+// hop between them (a quarter frame, as they are windowed on both sides)
+#define FADECORE_SPECTRAL_FFT_SIZE 2048
+#define FADECORE_SPECTRAL_HOP (FADECORE_SPECTRAL_FFT_SIZE / 4)
+
+/* Converts a gain (or a linear sample level) to dB (with -inf for silence). */
+static inline double gain_to_db (double gain)
+{
+    return 20 * log10 (gain);
+}
+
+/* Converts a level in dB to a gain. */
+static inline double db_to_gain (double db)
+{
+    return pow (10, db / 20);
+}
+
+/* A bounded lock-free queue for any number of producer and consumer threads
+ * (after Dmitry Vyukov's design); Capacity must be a power of two. Each slot
+ * carries a sequence number telling whether it is ready for being written or
+ * read in the current lap around the queue. */
+template<class T, int Capacity>
+class BoundedQueue
+{
+public:
+    BoundedQueue ()
+    {
+        for (int i = 0; i < Capacity; i++)
+            m_slots[i].sequence.store (i, std::memory_order_relaxed);
+    }
+
+    bool push (const T & value)
+    {
+        uint64_t pos = m_head.load (std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot & slot = m_slots[pos & (Capacity - 1)];
+            int64_t diff = (int64_t) slot.sequence.load (
+                std::memory_order_acquire) - (int64_t) pos;
+
+            if (diff < 0)
+                return false;  // full
+            if (diff > 0)
+                pos = m_head.load (std::memory_order_relaxed);
+            else if (m_head.compare_exchange_weak (pos, pos + 1,
+                std::memory_order_relaxed))
+            {
+                slot.value = value;
+                slot.sequence.store (pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+    }
+
+    bool pop (T & value)
+    {
+        uint64_t pos = m_tail.load (std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot & slot = m_slots[pos & (Capacity - 1)];
+            int64_t diff = (int64_t) slot.sequence.load (
+                std::memory_order_acquire) - (int64_t) (pos + 1);
+
+            if (diff < 0)
+                return false;  // empty
+            if (diff > 0)
+                pos = m_tail.load (std::memory_order_relaxed);
+            else if (m_tail.compare_exchange_weak (pos, pos + 1,
+                std::memory_order_relaxed))
+            {
+                value = slot.value;
+                slot.sequence.store (pos + Capacity, std::memory_order_release);
+                return true;
+            }
+        }
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence;
+        T value;
+    };
+
+    alignas (64) std::atomic<uint64_t> m_head {0};
+    alignas (64) std::atomic<uint64_t> m_tail {0};
+    alignas (64) Slot m_slots[Capacity];
+};
+
+/* A gain envelope: the gain either stays constant or ramps to a target gain
+ * within a given time. Ramps are linear in dB, i.e., the gain is multiplied by
+ * a constant ratio in each frame. The state is kept in seconds, so a ramp
+ * keeps its speed when the sample rate changes (e.g., as it continues into
+ * the next song); the per-frame ratio and the frame count are derived from it
+ * whenever they are needed for a new rate. */
+class GainEnvelope
+{
+public:
+    void set_rate (int rate)
+    {
+        if (rate != m_rate)
+        {
+            m_rate = rate;
+            m_stale = true;
+        }
+    }
+
+    void set (double gain)
+    {
+        m_gain = m_target = gain;
+        m_seconds = 0;
+        m_ratio = 1;
+        m_remaining = 0;
+        m_stale = false;
+    }
+
+    void ramp_to (double target, double seconds)
+    {
+        if (seconds * m_rate < 1)
+        {
+            set (target);
+            return;
+        }
+
+        m_target = target;
+        m_seconds = seconds;
+        m_stale = true;
+    }
+
+    bool ramping () const
+        { return m_seconds > 0; }
+    double gain () const
+        { return m_gain; }
+    double ratio ()
+        { update (); return m_ratio; }
+
+    /* Returns for how many of the given frames the envelope keeps doing the
+     * same, i.e., where a block has to be split. */
+    int segment (int frames)
+    {
+        update ();
+        return ramping () ? std::min ((int64_t) frames, m_remaining) : frames;
+    }
+
+    /* Moves on by the given number of frames (at most one segment); returns
+     * whether a ramp ended. */
+    bool advance (int frames)
+    {
+        if (! ramping ())
+            return false;
+
+        update ();
+        m_remaining -= frames;
+        if (m_remaining > 0)
+        {
+            m_gain *= pow (m_ratio, frames);
+            m_seconds = (double) m_remaining / m_rate;
+            return false;
+        }
+
+        set (m_target);
+        return true;
+    }
+
+private:
+    // recomputes the per-frame state of a ramp for the current rate
+    void update ()
+    {
+        if (! m_stale)
+            return;
+
+        m_remaining = std::max ((int64_t) llround (m_seconds * m_rate),
+            (int64_t) 1);
+        m_ratio = pow (m_target / m_gain, 1.0 / m_remaining);
+        m_stale = false;
+    }
+
+    double m_gain = 1, m_target = 1;
+    // the remaining time (in seconds) of a ramp
+    double m_seconds = 0;
+    int m_rate = 44100;
+    // the per-frame state derived from the above
+    double m_ratio = 1;
+    int64_t m_remaining = 0;
+    bool m_stale = false;
+};
+
+/* Combines the envelopes of a fixed set of slots by multiplying their gains.
+ * As all ramps are linear in dB, so is their product: until the first of them
+ * ends, the combined gain is simply the product of the gains and changes by
+ * the product of the ratios in each frame. Slots which are at unity gain and
+ * not ramping (e.g., after their ramp finished) take no part in that. */
+template<int Slots>
+class EnvelopeCompositor
+{
+public:
+    GainEnvelope & slot (int slot)
+        { return m_slots[slot]; }
+
+    void set_rate (int rate)
+    {
+        for (GainEnvelope & envelope : m_slots)
+            envelope.set_rate (rate);
+    }
+
+    void reset ()
+    {
+        for (GainEnvelope & envelope : m_slots)
+            envelope.set (1);
+    }
+
+    /* Returns for how many of the given frames the combined envelope keeps
+     * doing the same, and combines gain () and ratio () for them. */
+    int segment (int frames)
+    {
+        m_gain = m_ratio = 1;
+        m_ramping = false;
+
+        for (GainEnvelope & envelope : m_slots)
+        {
+            if (! envelope.ramping ())
+            {
+                m_gain *= envelope.gain ();
+                continue;
+            }
+
+            frames = envelope.segment (frames);
+            m_gain *= envelope.gain ();
+            m_ratio *= envelope.ratio ();
+            m_ramping = true;
+        }
+
+        return frames;
+    }
+
+    bool ramping () const
+        { return m_ramping; }
+    double gain () const
+        { return m_gain; }
+    double ratio () const
+        { return m_ratio; }
+
+    /* Moves all slots on by the given number of frames (at most one segment);
+     * returns a bit mask of the slots where a ramp ended. */
+    unsigned advance (int frames)
+    {
+        unsigned ended = 0;
+        for (int s = 0; s < Slots; s++)
+        {
+            if (m_slots[s].advance (frames))
+                ended |= 1 << s;
+        }
+
+        return ended;
+    }
+
+private:
+    GainEnvelope m_slots[Slots];
+    double m_gain = 1, m_ratio = 1;
+    bool m_ramping = false;
+};
+
+/* The gains of the lanes used by apply_gain_ramp() relative to the first
+ * frame of a chunk, and the ratio from one chunk to the next. As they only
+ * depend on the ratio of the ramp and the number of channels, they are
+ * rebuilt only when one of those changes. */
+struct RampTable
+{
+    float lane_ratio[FADECORE_MAX_CHANNELS * FADECORE_METER_LANE_FRAMES] = {};
+    float chunk_ratio = 1;
+    double ratio = 0;
+    int channels = 0;
+
+    void update (double new_ratio, int new_channels)
+    {
+        if (new_ratio == ratio && new_channels == channels)
+            return;
+
+        ratio = new_ratio;
+        channels = new_channels;
+        for (int l = 0; l < channels * FADECORE_METER_LANE_FRAMES; l++)
+            lane_ratio[l] = pow (ratio, l / channels);
+        chunk_ratio = pow (ratio, FADECORE_METER_LANE_FRAMES);
+    }
+};
+
+/* The peak and the sum of squares of a signal, accumulated separately for
+ * each of FADECORE_METER_LANE_FRAMES frames worth of interleaved samples. */
+struct LevelMeter
+{
+    float peak[FADECORE_MAX_CHANNELS * FADECORE_METER_LANE_FRAMES] = {};
+    float square_sum[FADECORE_MAX_CHANNELS * FADECORE_METER_LANE_FRAMES] = {};
+    int frames = 0;
+
+    /* Combines the lanes into the peak and RMS level of each channel. */
+    void levels (int channels, float * peaks, float * rms) const
+    {
+        const int lanes = channels * FADECORE_METER_LANE_FRAMES;
+        for (int c = 0; c < channels; c++)
+        {
+            float channel_peak = 0;
+            float channel_square_sum = 0;
+            for (int l = c; l < lanes; l += channels)
+            {
+                channel_peak = fmaxf (channel_peak, peak[l]);
+                channel_square_sum += square_sum[l];
+            }
+
+            peaks[c] = channel_peak;
+            rms[c] = frames ? sqrtf (channel_square_sum / frames) : 0;
+        }
+    }
+};
+
+/* A one-pole low-pass filter on the final gain of each channel, so that any
+ * jump of the combined envelopes (e.g., a reset, or a sequence being
+ * cancelled) turns into a short glide instead of a click. While the gain
+ * follows the envelopes continuously, the filter is settled and bypassed;
+ * it only runs for the few milliseconds after a jump. */
+struct GainSmoother
+{
+    // the gain applied to the last frame of each channel while smoothing
+    float gain[FADECORE_MAX_CHANNELS] = {};
+    // the gain the envelopes are expected to continue with
+    double expected = 1;
+    bool smoothing = false;
+    float coefficient = 1;
+    float ms = 0;
+    int rate = 0;
+
+    // recomputes the coefficient if the time constant or the rate changed
+    void update (float new_ms, int new_rate)
+    {
+        if (new_ms == ms && new_rate == rate)
+            return;
+
+        ms = new_ms;
+        rate = new_rate;
+        coefficient = 1 - exp (-1000 / (std::max (ms, 0.01f) * rate));
+    }
+
+    /* Ends any glide right away, e.g., after the audio itself was
+     * interrupted. */
+    void settle ()
+        { smoothing = false; }
+
+    /* Checks whether the envelopes jumped, given the gain at the start of a
+     * segment; returns whether the segment has to be smoothed. */
+    bool check (double start, int channels)
+    {
+        if (! smoothing && fabs (start - expected) >
+            FADECORE_SMOOTHER_EPSILON * fmax (start, expected))
+        {
+            for (int c = 0; c < channels; c++)
+                gain[c] = expected;
+            smoothing = true;
+        }
+
+        return smoothing;
+    }
+
+    /* Records the gain the envelopes continue with after a segment; the
+     * filter settles once all channels are close enough to it. */
+    void next (double end, int channels)
+    {
+        expected = end;
+        if (! smoothing)
+            return;
+
+        for (int c = 0; c < channels; c++)
+        {
+            if (fabs (gain[c] - end) > FADECORE_SMOOTHER_EPSILON * end)
+                return;
+        }
+
+        smoothing = false;
+    }
+};
+
+// the clocks by which fades can be scheduled: the wall clock (in microseconds
+// since the epoch) or the position in the current song (in milliseconds)
+enum class FadeClock {WallClock, SongPosition};
+
+/* Events (e.g., the start of a fade-out) which are scheduled at a time of one
+ * of the clocks, at most one for each clock. For each block of audio, it tells
+ * at which frame the first of them falls, so that it can start exactly there
+ * rather than at the next block. */
+template<class T>
+class FadeScheduler
+{
+public:
+    void schedule (FadeClock clock, int64_t at, const T & event)
+    {
+        Entry & entry = m_entries[(int) clock];
+        entry.at = at;
+        entry.event = event;
+        entry.scheduled = true;
+    }
+
+    void cancel (FadeClock clock)
+        { m_entries[(int) clock].scheduled = false; }
+
+    void clear ()
+    {
+        for (Entry & entry : m_entries)
+            entry.scheduled = false;
+    }
+
+    /* Drops the events which are due for longer than a second already (e.g.,
+     * as they passed while paused or before a seek), given the wall-clock
+     * time and the song position (in frames at the given rate) of a block;
+     * returns how many were dropped. */
+    int drop_overdue (int64_t now, int64_t position, int rate)
+    {
+        int dropped = 0;
+        for (int c = 0; c < CLOCKS; c++)
+        {
+            if (m_entries[c].scheduled &&
+                offset ((FadeClock) c, now, position, rate) < -rate)
+            {
+                m_entries[c].scheduled = false;
+                dropped++;
+            }
+        }
+
+        return dropped;
+    }
+
+    /* Returns at which frame of a block (starting at the given wall-clock
+     * time and song position, and having the given number of frames) the
+     * first event falls, or -1 if none falls within the block. That event is
+     * taken out of the schedule and returned in event; one which is overdue
+     * falls at the first frame. */
+    int next (int64_t now, int64_t position, int frames, int rate, T & event)
+    {
+        int64_t first = frames;
+        int found = -1;
+
+        for (int c = 0; c < CLOCKS; c++)
+        {
+            if (! m_entries[c].scheduled)
+                continue;
+
+            int64_t at = std::max (offset ((FadeClock) c, now, position, rate),
+                (int64_t) 0);
+            if (at < first)
+            {
+                first = at;
+                found = c;
+            }
+        }
+
+        if (found < 0)
+            return -1;
+
+        m_entries[found].scheduled = false;
+        event = m_entries[found].event;
+        return first;
+    }
+
+private:
+    static constexpr int CLOCKS = 2;
+
+    struct Entry
+    {
+        int64_t at = 0;
+        T event = T ();
+        bool scheduled = false;
+    };
+
+    // how many frames after the start of a block the event of a clock is due
+    int64_t offset (FadeClock clock, int64_t now, int64_t position,
+        int rate) const
+    {
+        const Entry & entry = m_entries[(int) clock];
+        return (clock == FadeClock::WallClock) ?
+            (entry.at - now) * rate / 1000000 :
+            entry.at * rate / 1000 - position;
+    }
+
+    Entry m_entries[CLOCKS];
+};
+
+/* A ring of interleaved samples through which a signal is delayed by the
+ * number of them in use (e.g., for a lookahead or the echoes of an echo-out).
+ * After a reset, the samples which are still in the ring are stale and come
+ * out as silence, without the ring being cleared at once. */
+class DelayLine
+{
+public:
+    int capacity () const
+        { return m_data.size (); }
+    int length () const
+        { return m_length; }
+
+    /* Allocates the ring for the given number of samples, all of which are
+     * in use; it is only reallocated if its capacity changes. */
+    void allocate (int samples)
+    {
+        if (samples != capacity ())
+            m_data.resize (samples);
+        m_length = samples;
+        reset ();
+    }
+
+    /* Uses the given number of samples (at most the capacity) from now on,
+     * starting out silent. */
+    void set_length (int samples)
+    {
+        m_length = std::min (samples, capacity ());
+        reset ();
+    }
+
+    /* Forgets all audio, e.g., after a flush. */
+    void reset ()
+    {
+        m_pos = 0;
+        m_stale = m_length;
+    }
+
+    /* Returns the samples at the current position, to be read and written in
+     * place, limiting their number to the end of the ring; stale ones are
+     * cleared first. advance () moves on past them. */
+    float * next (int & samples)
+    {
+        samples = std::min (samples, m_length - m_pos);
+        int stale = std::min (samples, m_stale);
+        std::fill (m_data.begin () + m_pos, m_data.begin () + m_pos + stale,
+            0.0f);
+        m_stale -= stale;
+        return m_data.data () + m_pos;
+    }
+
+    void advance (int samples)
+    {
+        m_pos += samples;
+        if (m_pos == m_length)
+            m_pos = 0;
+    }
+
+    /* Delays the given samples in place, exchanging them with the oldest
+     * ones in the ring. */
+    void delay (float * data, int samples);
+
+private:
+    std::vector<float> m_data;
+    int m_length = 0;
+    int m_pos = 0;
+    // the number of samples from the current position on which are stale
+    int m_stale = 0;
+};
+
+/* An in-place radix-2 complex FFT of a fixed size with precomputed twiddle
+ * factors and bit reversal permutation. */
+template<int Size>
+class Fft
+{
+public:
+    Fft ()
+    {
+        for (int i = 0; i < Size / 2; i++)
+        {
+            m_cos[i] = cos (2 * M_PI * i / Size);
+            m_sin[i] = -sin (2 * M_PI * i / Size);
+        }
+
+        for (int i = 0, j = 0; i < Size; i++)
+        {
+            m_reversed[i] = j;
+            int bit = Size >> 1;
+            for (; j & bit; bit >>= 1)
+                j ^= bit;
+            j |= bit;
+        }
+    }
+
+    void transform (float * re, float * im) const
+    {
+        for (int i = 0; i < Size; i++)
+        {
+            int j = m_reversed[i];
+            if (i < j)
+            {
+                float t = re[i]; re[i] = re[j]; re[j] = t;
+                t = im[i]; im[i] = im[j]; im[j] = t;
+            }
+        }
+
+        for (int half = 1, step = Size / 2; half < Size; half <<= 1, step >>= 1)
+        {
+            for (int start = 0; start < Size; start += 2 * half)
+            {
+                for (int k = 0; k < half; k++)
+                {
+                    float wr = m_cos[k * step], wi = m_sin[k * step];
+                    int a = start + k, b = a + half;
+                    float tr = re[b] * wr - im[b] * wi;
+                    float ti = re[b] * wi + im[b] * wr;
+                    re[b] = re[a] - tr; im[b] = im[a] - ti;
+                    re[a] += tr; im[a] += ti;
+                }
+            }
+        }
+    }
+
+private:
+    float m_cos[Size / 2], m_sin[Size / 2];
+    int m_reversed[Size];
+};
+
+/* Fades the frequencies of a signal one after another: a streaming STFT with
+ * Hann windows on both sides at 75 % overlap, whose bins are weighted by gain
+ * curves while a fade runs. The output lags behind the input by one FFT frame;
+ * as long as no bin is weighted, the audio is just delayed by as much, without
+ * any transforms. All buffers are allocated by setup (). */
+class SpectralFade
+{
+public:
+    bool enabled () const
+        { return m_channels > 0; }
+
+    /* Returns by how many frames the output lags behind the input. */
+    int delay () const
+        { return enabled () ? FADECORE_SPECTRAL_FFT_SIZE : 0; }
+
+    /* Prepares for a stream with the given format (or for none if there are no
+     * channels), going on with the audio of the previous one if it continues
+     * and the format is the same. */
+    void setup (int channels, int rate, bool continues);
+
+    /* Forgets all audio, e.g., after a flush. */
+    void reset ();
+
+    /* Processes the given interleaved frames in place, given how far the fade
+     * has progressed (from 0 to 1, as a fraction of the floor in dB) and the
+     * floor: at that progress, each bin is attenuated so that it follows a
+     * fade which ends after its share of the duration. As the plain envelope
+     * is applied on top of that, no bin is weighted at the start and at the
+     * end of a fade. */
+    void process (float * data, int frames, float progress, double floor);
+
+private:
+    void hop (float progress, double floor);
+
+    int m_channels = 0;
+    // per channel, the input of the current frame followed by the current hop,
+    // and the overlapping output of the frames so far
+    std::vector<float> m_input, m_output;
+    // the number of frames in the current hop
+    int m_fill = 0;
+    // whether the output comes from the transforms, and for how many hops no
+    // bin was weighted anymore
+    bool m_transforming = false;
+    int m_unweighted_hops = 0;
+
+    float m_window[FADECORE_SPECTRAL_FFT_SIZE] = {};
+    float m_partial[FADECORE_SPECTRAL_FFT_SIZE] = {};
+    float m_inverse_share[FADECORE_SPECTRAL_FFT_SIZE / 2 + 1] = {};
+    float m_gain[FADECORE_SPECTRAL_FFT_SIZE / 2 + 1] = {};
+    float m_frame[FADECORE_SPECTRAL_FFT_SIZE] = {};
+    float m_re[FADECORE_SPECTRAL_FFT_SIZE / 2 + 1] = {};
+    float m_im[FADECORE_SPECTRAL_FFT_SIZE / 2 + 1] = {};
+};
+
+/* Slows a signal down without changing its pitch by WSOLA (waveform
+ * similarity overlap-add): the output is put together from Hann windowed
+ * frames at 50 % overlap, each of which is taken from the input less than a
+ * hop after the one before (depending on the tempo) -- exactly where it
+ * continues the previous one best within a tolerance. At full tempo, the
+ * audio passes through untouched. All buffers are allocated by setup () and
+ * only grow if a block is larger than any before. */
+class TimeStretch
+{
+public:
+    bool enabled () const
+        { return m_channels > 0; }
+
+    /* Returns by how many frames (of the input) the output lags behind the
+     * input because of the stretching, i.e., how many are still buffered. */
+    int delay () const
+        { return m_stretching ? m_frames - (m_previous + m_hop) : 0; }
+
+    /* Prepares for a stream with the given format (or for none if there are no
+     * channels). */
+    void setup (int channels, int rate);
+
+    /* Forgets all audio, e.g., after a flush. */
+    void reset ()
+    {
+        m_stretching = false;
+        m_frames = 0;
+    }
+
+    /* Stretches the given interleaved frames to the given tempo, returning
+     * the output (the given frames themselves or more of them in a buffer of
+     * the stretch, which is valid until the next call) and setting the number
+     * of its frames. Going back to full tempo lets out all the audio which is
+     * still buffered. */
+    const float * process (const float * data, int frames, double tempo,
+        int & output_frames);
+
+private:
+    void reserve_output (int frames);
+    int best_frame (int nominal);
+    void overlap_add (float * output, int next);
+
+    int m_channels = 0;
+    // the hop between the frames of the output (half a frame), and how far
+    // (in frames) a frame may be moved
+    int m_hop = 0;
+    int m_tolerance = 0;
+    std::vector<float> m_window;
+
+    bool m_stretching = false;
+    // the buffered input, where the last frame started in there and where the
+    // next one would start at the tempo (both relative to the buffer)
+    std::vector<float> m_input;
+    int m_frames = 0;
+    int m_previous = 0;
+    double m_position = 0;
+    // the stretched output of the current block
+    std::vector<float> m_output;
+};
+
+/* The DSP kernels; see fadecore.cc. */
+void apply_gain (float * data, int samples, float gain);
+void apply_gain_ramp (float * data, int samples, int channels, double gain,
+    const RampTable & table, LevelMeter & meter);
+void apply_smoothed_gain_ramp (float * data, int samples, int channels,
+    double gain, double ratio, GainSmoother & smoother);
+void apply_side_gain_ramp (float * data, int frames, double gain,
+    const RampTable & table);
+void apply_echo (float * data, float * line, int samples, int channels,
+    double gain, float feedback, const RampTable & table);
+float correlate (const float * a, const float * b, int samples);
+
+/* Returns which variant of the DSP kernels runs on this CPU. */
+const char * kernel_variant ();
+
+#endif // FADECORE_H
@@ -0,0 +1,48 @@
+/*
+ * Audacious FadeOut Plugin
+ *
+ * The checks of the tests: each test program counts the checks which failed
+ * and exits with an error if there were any.
+ *
+ * Copyright (C) 2008–2018  Christian Spurk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int failures = 0;
+
+static void check (bool condition, const char * what)
+{
+    if (! condition)
+    {
+        fprintf (stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+/* Reports the failed checks; returns the exit status of the test program. */
+static int check_result ()
+{
+    if (failures)
+        fprintf (stderr, "%d check(s) failed\n", failures);
+
+    return failures ? 1 : 0;
+}
+
+#endif // CHECK_H
@@ -0,0 +1,136 @@
+/*
+ * Audacious FadeOut Plugin
+ *
+ * Tests of the gain envelope: a ramp which continues across songs with
+ * different sample rates has to follow the same curve in time as one at a
+ * single rate, and has to end exactly once, when its time is up.
+ *
+ * Copyright (C) 2008–2018  Christian Spurk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fadecore.h"
+#include "check.h"
+
+#include <stdio.h>
+
+// length of the test ramp (in seconds) and its target level (in dB)
+#define RAMP_SECONDS 3.0
+#define RAMP_DB -60.0
+// number of frames the envelope is moved on by at once (as by the plugin)
+#define BLOCK_FRAMES 512
+// largest tolerated deviation from the expected curve (in dB)
+#define TOLERANCE_DB 0.01
+
+/* Moves the envelope on by the given time at the given rate, block by block
+ * and split into segments as the plugin does it; returns how many ramps
+ * ended on the way and adds the time which actually passed. */
+static int run (GainEnvelope & envelope, int rate, double seconds,
+    double & elapsed)
+{
+    envelope.set_rate (rate);
+
+    int ended = 0;
+    int64_t frames = llround (seconds * rate);
+    while (frames > 0)
+    {
+        int block = std::min ((int64_t) BLOCK_FRAMES, frames);
+        for (int done = 0; done < block; )
+        {
+            int segment = envelope.segment (block - done);
+            if (envelope.advance (segment))
+                ended++;
+            done += segment;
+        }
+
+        frames -= block;
+        elapsed += (double) block / rate;
+    }
+
+    return ended;
+}
+
+/* Checks the envelope against the ramp which is linear in dB over time. */
+static void check_curve (GainEnvelope & envelope, double elapsed,
+    const char * what)
+{
+    double expected = RAMP_DB * std::min (elapsed / RAMP_SECONDS, 1.0);
+    double db = gain_to_db (envelope.gain ());
+
+    if (fabs (db - expected) > TOLERANCE_DB)
+        fprintf (stderr, "%s: %.4f dB instead of %.4f dB after %.6f s\n",
+            what, db, expected, elapsed);
+    check (fabs (db - expected) <= TOLERANCE_DB, what);
+}
+
+/* A ramp which continues from 44.1 kHz to 96 kHz and then to 48 kHz. */
+static void test_rate_changes ()
+{
+    GainEnvelope envelope;
+    envelope.set_rate (44100);
+    envelope.ramp_to (db_to_gain (RAMP_DB), RAMP_SECONDS);
+
+    double elapsed = 0;
+    int ended = run (envelope, 44100, 1, elapsed);
+    check (ended == 0 && envelope.ramping (), "ramping after 44.1 kHz");
+    check_curve (envelope, elapsed, "gain after 44.1 kHz");
+
+    ended += run (envelope, 96000, 1, elapsed);
+    check (ended == 0 && envelope.ramping (), "ramping after 96 kHz");
+    check_curve (envelope, elapsed, "gain after 96 kHz");
+
+    // just before the end of the ramp
+    ended += run (envelope, 48000, RAMP_SECONDS - elapsed - 0.001, elapsed);
+    check (ended == 0 && envelope.ramping (), "ramping before the end");
+    check_curve (envelope, elapsed, "gain before the end");
+
+    // the ramp ends within the next block, and only there
+    ended += run (envelope, 48000, 0.002, elapsed);
+    check (ended == 1, "ramp ends once at 3 s");
+    check (! envelope.ramping (), "not ramping after the end");
+    check_curve (envelope, elapsed, "gain at the end");
+
+    ended += run (envelope, 48000, 1, elapsed);
+    check (ended == 1, "ramp does not end again");
+    check (envelope.gain () == db_to_gain (RAMP_DB), "gain stays at target");
+}
+
+/* The same ramp at a single rate ends after exactly as many frames as it
+ * lasts, even if the rate is set again while it runs. */
+static void test_single_rate ()
+{
+    GainEnvelope envelope;
+    envelope.set_rate (48000);
+    envelope.ramp_to (db_to_gain (RAMP_DB), RAMP_SECONDS);
+
+    int64_t frames = 0;
+    while (envelope.ramping ())
+    {
+        envelope.set_rate (48000);
+        int segment = envelope.segment (BLOCK_FRAMES);
+        envelope.advance (segment);
+        frames += segment;
+    }
+
+    check (frames == (int64_t) (RAMP_SECONDS * 48000), "length at 48 kHz");
+}
+
+int main ()
+{
+    test_rate_changes ();
+    test_single_rate ();
+
+    return check_result ();
+}
@@ -0,0 +1,322 @@
+/*
+ * Audacious FadeOut Plugin
+ *
+ * Tests of what flushing (e.g., for a seek) does: the envelopes go on without
+ * a jump however often the audio is flushed, a glide of the gain smoother ends
+ * with the flush instead of carrying over into the audio after it, and none of
+ * the audio before the flush comes out of the buffers after it.
+ *
+ * Copyright (C) 2008–2018  Christian Spurk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fadecore.h"
+#include "check.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#define RATE 48000
+#define CHANNELS 2
+// time constant (in ms) of the gain smoother
+#define SMOOTHING_MS 5
+// largest tolerated relative deviation of a frame's gain from the ramp
+#define TOLERANCE 1e-4
+// length (in frames) of the delay lines
+#define LINE_FRAMES 100
+// tempo of the time stretching
+#define TEMPO 0.6
+
+/* Applies the envelope to the interleaved samples as the plugin does it,
+ * i.e., in segments, smoothing jumps of the gain. */
+static void apply (GainEnvelope & envelope, GainSmoother & smoother,
+    float * data, int frames)
+{
+    RampTable table;
+    LevelMeter meter;
+
+    while (frames > 0)
+    {
+        int segment = envelope.segment (frames);
+        double ratio = envelope.ramping () ? envelope.ratio () : 1;
+
+        if (smoother.check (envelope.gain (), CHANNELS))
+        {
+            apply_smoothed_gain_ramp (data, segment * CHANNELS, CHANNELS,
+                envelope.gain (), ratio, smoother);
+        }
+        else if (envelope.ramping ())
+        {
+            table.update (ratio, CHANNELS);
+            apply_gain_ramp (data, segment * CHANNELS, CHANNELS,
+                envelope.gain (), table, meter);
+        }
+        else if (envelope.gain () != 1)
+            apply_gain (data, segment * CHANNELS, envelope.gain ());
+
+        smoother.next (envelope.gain () * pow (ratio, segment), CHANNELS);
+        envelope.advance (segment);
+
+        data += segment * CHANNELS;
+        frames -= segment;
+    }
+}
+
+/* A fade-out which is flushed after every block of a random length goes on
+ * from frame to frame by its ratio, without any jump at the flushes. */
+static void test_ramp_across_flushes ()
+{
+    GainEnvelope envelope;
+    GainSmoother smoother;
+    envelope.set_rate (RATE);
+    smoother.update (SMOOTHING_MS, RATE);
+    envelope.ramp_to (db_to_gain (-60), 2);
+    double ratio = envelope.ratio ();
+
+    std::vector<float> output;
+    srand (1);
+    for (int frames = 0; frames < 3 * RATE; )
+    {
+        int block = 1 + rand () % 1024;
+        std::vector<float> data (block * CHANNELS, 1.0f);
+        apply (envelope, smoother, data.data (), block);
+        output.insert (output.end (), data.begin (), data.end ());
+
+        smoother.settle ();  // as flush () does it
+        frames += block;
+    }
+
+    int jumps = 0;
+    int ramp_frames = 2 * RATE;
+    for (int f = 1; f < (int) output.size () / CHANNELS; f++)
+    {
+        double expected = (f < ramp_frames) ? ratio : 1;
+        for (int c = 0; c < CHANNELS; c++)
+        {
+            double step = output[f * CHANNELS + c] /
+                output[(f - 1) * CHANNELS + c];
+            if (fabs (step / expected - 1) > TOLERANCE)
+                jumps++;
+        }
+    }
+
+    check (jumps == 0, "no jumps at flushes");
+    check (fabs (gain_to_db (output.back ()) + 60) < 0.01,
+        "ramp reaches -60 dB");
+}
+
+/* Returns the gain of the first frame after a jump of the envelope from 1 to
+ * 0.1 and a few frames, with or without a flush in between. */
+static float gain_after_jump (bool flush)
+{
+    GainEnvelope envelope;
+    GainSmoother smoother;
+    envelope.set_rate (RATE);
+    smoother.update (SMOOTHING_MS, RATE);
+
+    std::vector<float> data (64 * CHANNELS, 1.0f);
+    apply (envelope, smoother, data.data (), 64);
+
+    envelope.set (0.1);
+    apply (envelope, smoother, data.data (), 16);
+    check (data[0] > 0.9f, "jump glides");
+
+    if (flush)
+        smoother.settle ();
+
+    std::fill (data.begin (), data.end (), 1.0f);
+    apply (envelope, smoother, data.data (), 64);
+    return data[0];
+}
+
+/* A glide which is under way ends with a flush. */
+static void test_settle ()
+{
+    check (gain_after_jump (false) > 0.2f, "glide goes on without a flush");
+    check (gain_after_jump (true) == 0.1f, "no glide after a flush");
+}
+
+/* A jump after a flush still glides. */
+static void test_jump_after_settle ()
+{
+    GainEnvelope envelope;
+    GainSmoother smoother;
+    envelope.set_rate (RATE);
+    smoother.update (SMOOTHING_MS, RATE);
+
+    std::vector<float> data (64 * CHANNELS, 1.0f);
+    apply (envelope, smoother, data.data (), 64);
+    smoother.settle ();
+
+    envelope.set (0.1);
+    apply (envelope, smoother, data.data (), 64);
+    check (data[0] > 0.9f, "jump after a flush glides");
+}
+
+/* After a reset, a delay line lets out silence until the samples after it
+ * come out again, in their order. */
+static void test_delay_line_reset ()
+{
+    DelayLine line;
+    line.allocate (LINE_FRAMES * CHANNELS);
+
+    std::vector<float> data (64 * CHANNELS);
+    for (int block = 0; block < 3; block++)
+    {
+        std::fill (data.begin (), data.end (), -1.0f);
+        line.delay (data.data (), data.size ());
+    }
+
+    line.reset ();
+
+    data.resize (3 * LINE_FRAMES * CHANNELS);
+    for (int i = 0; i < (int) data.size (); i++)
+        data[i] = i + 1;
+    line.delay (data.data (), data.size ());
+
+    int wrong = 0;
+    for (int i = 0; i < (int) data.size (); i++)
+    {
+        float expected = (i < LINE_FRAMES * CHANNELS) ? 0 :
+            i + 1 - LINE_FRAMES * CHANNELS;
+        if (data[i] != expected)
+            wrong++;
+    }
+
+    check (wrong == 0, "delay line is silent after a reset");
+}
+
+/* After a reset, the whole feedback line (as used by echo-outs) reads as
+ * silence, even though it is shorter than its capacity. */
+static void test_feedback_line_reset ()
+{
+    DelayLine line;
+    line.allocate (2 * LINE_FRAMES * CHANNELS);
+    line.set_length (LINE_FRAMES * CHANNELS);
+
+    for (int written = 0; written < 3 * LINE_FRAMES * CHANNELS; )
+    {
+        int samples = 48 * CHANNELS;
+        float * samples_at = line.next (samples);
+        std::fill (samples_at, samples_at + samples, -1.0f);
+        line.advance (samples);
+        written += samples;
+    }
+
+    line.reset ();
+
+    int loud = 0;
+    for (int read = 0; read < LINE_FRAMES * CHANNELS; )
+    {
+        int samples = 48 * CHANNELS;
+        const float * samples_at = line.next (samples);
+        for (int i = 0; i < samples; i++)
+        {
+            if (samples_at[i] != 0)
+                loud++;
+        }
+        line.advance (samples);
+        read += samples;
+    }
+
+    check (loud == 0, "feedback line is silent after a reset");
+}
+
+/* After a reset in the middle of a spectral fade, the audio comes out
+ * delayed by an FFT frame again, with silence before it. */
+static void test_spectral_fade_reset ()
+{
+    static SpectralFade spectral;  // too large for the stack
+    spectral.setup (CHANNELS, RATE, false);
+
+    std::vector<float> data (FADECORE_SPECTRAL_HOP * CHANNELS);
+    for (int hop = 0; hop < 16; hop++)
+    {
+        std::fill (data.begin (), data.end (), -1.0f);
+        spectral.process (data.data (), FADECORE_SPECTRAL_HOP, 0.5f, 0.01);
+    }
+
+    spectral.reset ();
+
+    int frames = spectral.delay () + 4 * FADECORE_SPECTRAL_HOP;
+    data.assign (frames * CHANNELS, 1.0f);
+    spectral.process (data.data (), frames, 0, 0.01);
+
+    int wrong = 0;
+    for (int i = 0; i < (int) data.size (); i++)
+    {
+        float expected = (i < spectral.delay () * CHANNELS) ? 0 : 1;
+        if (data[i] != expected)
+            wrong++;
+    }
+
+    check (wrong == 0, "spectral fade starts over after a reset");
+}
+
+/* After a reset, nothing of the audio buffered by the time stretching comes
+ * out anymore, whether it goes on stretching or not. */
+static void test_time_stretch_reset ()
+{
+    TimeStretch stretch;
+    stretch.setup (CHANNELS, RATE);
+
+    std::vector<float> data (1024 * CHANNELS);
+    for (int block = 0; block < 8; block++)
+    {
+        int frames;
+        std::fill (data.begin (), data.end (), -1.0f);
+        stretch.process (data.data (), 1024, TEMPO, frames);
+    }
+    check (stretch.delay () > 0, "stretch buffers audio");
+
+    stretch.reset ();
+    check (stretch.delay () == 0, "no audio buffered after a reset");
+
+    int frames;
+    std::fill (data.begin (), data.end (), 1.0f);
+    const float * output = stretch.process (data.data (), 1024, 1, frames);
+    check (output == data.data () && frames == 1024,
+        "full tempo passes through after a reset");
+
+    int wrong = 0, total = 0;
+    for (int block = 0; block < 8; block++)
+    {
+        output = stretch.process (data.data (), 1024, TEMPO, frames);
+        for (int i = 0; i < frames * CHANNELS; i++)
+        {
+            if (fabs (output[i] - 1) > TOLERANCE)
+                wrong++;
+        }
+        total += frames;
+    }
+
+    check (total > 8 * 1024, "stretch slows down after a reset");
+    check (wrong == 0, "stretch starts over after a reset");
+}
+
+int main ()
+{
+    test_ramp_across_flushes ();
+    test_settle ();
+    test_jump_after_settle ();
+    test_delay_line_reset ();
+    test_feedback_line_reset ();
+    test_spectral_fade_reset ();
+    test_time_stretch_reset ();
+
+    return check_result ();
+}
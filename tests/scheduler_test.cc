@@ -0,0 +1,103 @@
+/*
+ * Audacious FadeOut Plugin
+ *
+ * Tests of the fade scheduler: a scheduled event has to fall exactly at its
+ * frame of a block, whichever clock it is scheduled by, and events which are
+ * long overdue have to be dropped.
+ *
+ * Copyright (C) 2008–2018  Christian Spurk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fadecore.h"
+#include "check.h"
+
+#define RATE 48000
+#define BLOCK_FRAMES 512
+// an arbitrary wall-clock time (in microseconds) at which the tests start
+#define START_TIME ((int64_t) 1500000000 * 1000000)
+
+/* Runs blocks from the given song position until an event falls into one;
+ * returns the song position (in frames) of that event, or -1 if there was
+ * none within the given number of blocks. */
+static int64_t find_event (FadeScheduler<int> & scheduler, int64_t position,
+    int blocks, int & event)
+{
+    for (int b = 0; b < blocks; b++, position += BLOCK_FRAMES)
+    {
+        int64_t now = START_TIME + position * 1000000 / RATE;
+        scheduler.drop_overdue (now, position, RATE);
+        int offset = scheduler.next (now, position, BLOCK_FRAMES, RATE,
+            event);
+        if (offset >= 0)
+            return position + offset;
+    }
+
+    return -1;
+}
+
+/* Events of both clocks fall at their frames, the earlier one first. */
+static void test_both_clocks ()
+{
+    FadeScheduler<int> scheduler;
+    // at 2.5 s of the song, and 1.25 s after the start
+    scheduler.schedule (FadeClock::SongPosition, 2500, 1);
+    scheduler.schedule (FadeClock::WallClock, START_TIME + 1250000, 2);
+
+    int event = 0;
+    int64_t position = find_event (scheduler, 0, 1000, event);
+    check (event == 2 && position == RATE * 5 / 4, "wall clock event");
+
+    position = find_event (scheduler, position - position % BLOCK_FRAMES +
+        BLOCK_FRAMES, 1000, event);
+    check (event == 1 && position == RATE * 5 / 2, "song position event");
+
+    check (find_event (scheduler, 0, 1000, event) < 0, "events taken out");
+}
+
+/* An event which is replaced, cancelled or long overdue does not fall. */
+static void test_cancel_and_overdue ()
+{
+    FadeScheduler<int> scheduler;
+    int event = 0;
+
+    scheduler.schedule (FadeClock::SongPosition, 1000, 1);
+    scheduler.schedule (FadeClock::SongPosition, 2000, 2);
+    int64_t position = find_event (scheduler, 0, 1000, event);
+    check (event == 2 && position == RATE * 2, "replaced event");
+
+    scheduler.schedule (FadeClock::SongPosition, 1000, 3);
+    scheduler.cancel (FadeClock::SongPosition);
+    check (find_event (scheduler, 0, 1000, event) < 0, "cancelled event");
+
+    // half a second late: still falls at the first frame
+    scheduler.schedule (FadeClock::SongPosition, 1000, 4);
+    position = find_event (scheduler, RATE * 3 / 2, 1, event);
+    check (event == 4 && position == RATE * 3 / 2, "late event");
+
+    // two seconds late: dropped
+    scheduler.schedule (FadeClock::SongPosition, 1000, 5);
+    int64_t now = START_TIME + 3000000;
+    check (scheduler.drop_overdue (now, RATE * 3, RATE) == 1, "overdue count");
+    check (find_event (scheduler, RATE * 3, 1, event) < 0, "overdue event");
+}
+
+int main ()
+{
+    test_both_clocks ();
+    test_cancel_and_overdue ();
+
+    return check_result ();
+}